@@ -0,0 +1,315 @@
+// Hash map from C strings to values of one type, e.g.
+//
+//   map_t(int) counts;
+//   initialize_map(&counts);
+//   map_set(&counts, "key", 1);
+//   int *count = map_get(&counts, "key");
+//
+// Open addressing over groups of MAP_GROUP_WIDTH slots. Every slot has a
+// control byte holding 7 bits of its key's hash (or EMPTY/DELETED), so a
+// probe matches a whole group of control bytes at once, with one SSE2
+// compare where available, and only looks at the keys whose bits match.
+// Keys and values are copied into chunks owned by the map: a pointer from
+// map_get stays valid until its key is deleted or the map is cleared.
+
+#ifndef MAP_H
+#define MAP_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MAP_GROUP_WIDTH 16
+#define MAP_CTRL_EMPTY ((int8_t)-128)
+#define MAP_CTRL_DELETED ((int8_t)-2)
+#define MAP_CHUNK_SIZE 4096
+
+typedef struct map_chunk_t {
+  struct map_chunk_t *next;
+  size_t used, size;
+} map_chunk_t;
+
+// The value lives voffset bytes after the key; 16 bytes keep four slots
+// in a cache line
+typedef struct {
+  unsigned hash;
+  unsigned voffset;
+  const char *key;
+} map_slot_t;
+
+typedef struct {
+  int8_t *ctrl;
+  map_slot_t *slots;
+  unsigned nslots, nnodes, ndeleted;
+  map_chunk_t *chunks;
+} map_base_t;
+
+typedef struct {
+  unsigned bucketidx;
+} map_iter_t;
+
+#define map_t(T)     \
+  struct {           \
+    map_base_t base; \
+    T *ref;          \
+    T tmp;           \
+  }
+
+#define initialize_map(m) memset(m, 0, sizeof(*(m)))
+
+#define destroy_map(m) destroy_map_(&(m)->base)
+
+// Drop every key but keep the table and the newest chunk for reuse
+#define clear_map(m) clear_map_(&(m)->base)
+
+#define map_get(m, key) ((m)->ref = map_get_(&(m)->base, key))
+
+#define map_set(m, key, value) \
+  ((m)->tmp = (value), map_set_(&(m)->base, key, &(m)->tmp, sizeof((m)->tmp)))
+
+// Same as map_get/map_set for callers that already hashed the key; a key
+// must always be given the same hash
+#define map_get_hashed(m, key, hash) ((m)->ref = map_get_hashed_(&(m)->base, key, hash))
+
+#define map_set_hashed(m, key, hash, value) \
+  ((m)->tmp = (value),                      \
+   map_set_hashed_(&(m)->base, key, hash, &(m)->tmp, sizeof((m)->tmp)))
+
+#define delete_map_value(m, key) delete_map_value_(&(m)->base, key)
+
+#define map_iter(m) map_iter_()
+
+#define map_next(m, iter) map_next_(&(m)->base, iter)
+
+// Value of the key map_next last returned
+#define map_iter_value(m, iter) ((m)->ref = map_iter_value_(&(m)->base, iter))
+
+typedef map_t(void *) map_void_t;
+typedef map_t(char *) map_str_t;
+typedef map_t(int) map_int_t;
+typedef map_t(char) map_char_t;
+typedef map_t(float) map_float_t;
+typedef map_t(double) map_double_t;
+
+// FNV-1a with a final avalanche, the control byte and the group both
+// come out of the low bits
+static inline unsigned map_hash(const char *str) {
+  unsigned hash = 2166136261u;
+  while (*str) {
+    hash ^= (unsigned char)*str++;
+    hash *= 16777619;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  return hash;
+}
+
+// Bit i is set when control byte i of the group equals byte
+static inline unsigned map_match(const int8_t *group, int8_t byte) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte)));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < MAP_GROUP_WIDTH; i++) {
+    mask |= (unsigned)(group[i] == byte) << i;
+  }
+  return mask;
+#endif
+}
+
+// Empty and deleted slots are the ones with the top bit set
+static inline unsigned map_match_free(const int8_t *group) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < MAP_GROUP_WIDTH; i++) {
+    mask |= (unsigned)(group[i] < 0) << i;
+  }
+  return mask;
+#endif
+}
+
+static inline void *map_alloc(map_base_t *m, size_t size) {
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  map_chunk_t *chunk = m->chunks;
+  if (!chunk || chunk->used + size > chunk->size) {
+    size_t capacity = size > MAP_CHUNK_SIZE ? size : MAP_CHUNK_SIZE;
+    chunk = malloc(sizeof(map_chunk_t) + capacity);
+    if (!chunk) return NULL;
+    chunk->next = m->chunks;
+    chunk->used = 0;
+    chunk->size = capacity;
+    m->chunks = chunk;
+  }
+  void *data = (char *)(chunk + 1) + chunk->used;
+  chunk->used += size;
+  return data;
+}
+
+// Groups are probed triangularly, which visits every group once when
+// their number is a power of two
+static inline int map_find(map_base_t *m, const char *key, unsigned hash) {
+  if (m->nslots == 0) return -1;
+  unsigned mask = m->nslots / MAP_GROUP_WIDTH - 1;
+  unsigned group = (hash >> 7) & mask;
+  for (unsigned step = 1;; step++) {
+    int8_t *ctrl = m->ctrl + group * MAP_GROUP_WIDTH;
+    unsigned match = map_match(ctrl, hash & 0x7f);
+    while (match) {
+      unsigned i = group * MAP_GROUP_WIDTH + __builtin_ctz(match);
+      if (m->slots[i].hash == hash && !strcmp(m->slots[i].key, key)) return i;
+      match &= match - 1;
+    }
+    // A key is never placed past a group that still has an empty slot
+    if (map_match(ctrl, MAP_CTRL_EMPTY)) return -1;
+    group = (group + step) & mask;
+  }
+}
+
+static inline unsigned map_free_slot(map_base_t *m, unsigned hash) {
+  unsigned mask = m->nslots / MAP_GROUP_WIDTH - 1;
+  unsigned group = (hash >> 7) & mask;
+  for (unsigned step = 1;; step++) {
+    unsigned match = map_match_free(m->ctrl + group * MAP_GROUP_WIDTH);
+    if (match) return group * MAP_GROUP_WIDTH + __builtin_ctz(match);
+    group = (group + step) & mask;
+  }
+}
+
+static inline int map_resize(map_base_t *m, unsigned nslots) {
+  int8_t *ctrl = malloc(nslots);
+  map_slot_t *slots = malloc(sizeof(map_slot_t) * nslots);
+  if (!ctrl || !slots) {
+    free(ctrl);
+    free(slots);
+    return -1;
+  }
+  memset(ctrl, MAP_CTRL_EMPTY, nslots);
+  map_base_t resized = *m;
+  resized.ctrl = ctrl;
+  resized.slots = slots;
+  resized.nslots = nslots;
+  resized.ndeleted = 0;
+  for (unsigned i = 0; i < m->nslots; i++) {
+    if (m->ctrl[i] < 0) continue;
+    unsigned j = map_free_slot(&resized, m->slots[i].hash);
+    ctrl[j] = m->slots[i].hash & 0x7f;
+    slots[j] = m->slots[i];
+  }
+  free(m->ctrl);
+  free(m->slots);
+  *m = resized;
+  return 0;
+}
+
+static inline void destroy_map_(map_base_t *m) {
+  map_chunk_t *chunk = m->chunks;
+  while (chunk) {
+    map_chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  free(m->ctrl);
+  free(m->slots);
+  memset(m, 0, sizeof(*m));
+}
+
+static inline void clear_map_(map_base_t *m) {
+  map_chunk_t *chunk = m->chunks;
+  if (chunk) {
+    map_base_t rest = {0};
+    rest.chunks = chunk->next;
+    destroy_map_(&rest);
+    chunk->next = NULL;
+    chunk->used = 0;
+  }
+  if (m->ctrl) memset(m->ctrl, MAP_CTRL_EMPTY, m->nslots);
+  m->nnodes = 0;
+  m->ndeleted = 0;
+}
+
+static inline void *map_get_hashed_(map_base_t *m, const char *key, unsigned hash) {
+  int i = map_find(m, key, hash);
+  return i >= 0 ? (char *)m->slots[i].key + m->slots[i].voffset : NULL;
+}
+
+static inline void *map_get_(map_base_t *m, const char *key) {
+  return map_get_hashed_(m, key, map_hash(key));
+}
+
+static inline int map_set_hashed_(map_base_t *m, const char *key, unsigned hash,
+                                  void *value, int vsize) {
+  int i = map_find(m, key, hash);
+  if (i >= 0) {
+    memcpy((char *)m->slots[i].key + m->slots[i].voffset, value, vsize);
+    return 0;
+  }
+
+  // Keep at least one slot in eight empty so probes always end; mostly
+  // deleted tables are rehashed in place instead of grown
+  if ((m->nnodes + m->ndeleted + 1) * 8 > m->nslots * 7) {
+    unsigned nslots = m->nslots ? m->nslots : MAP_GROUP_WIDTH;
+    if (m->nslots && m->nnodes * 2 >= m->nslots) nslots *= 2;
+    if (map_resize(m, nslots)) return -1;
+  }
+  size_t ksize = strlen(key) + 1;
+  size_t voffset = (ksize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  char *data = map_alloc(m, voffset + vsize);
+  if (!data) return -1;
+  memcpy(data, key, ksize);
+  memcpy(data + voffset, value, vsize);
+
+  unsigned j = map_free_slot(m, hash);
+  if (m->ctrl[j] == MAP_CTRL_DELETED) m->ndeleted--;
+  m->ctrl[j] = hash & 0x7f;
+  m->slots[j].hash = hash;
+  m->slots[j].key = data;
+  m->slots[j].voffset = voffset;
+  m->nnodes++;
+  return 0;
+}
+
+static inline int map_set_(map_base_t *m, const char *key, void *value, int vsize) {
+  return map_set_hashed_(m, key, map_hash(key), value, vsize);
+}
+
+// A group with an empty slot ends every probe that reaches it, so a slot
+// in such a group can go straight back to empty
+static inline void delete_map_value_(map_base_t *m, const char *key) {
+  int i = map_find(m, key, map_hash(key));
+  if (i < 0) return;
+  int8_t *group = m->ctrl + (i & ~(MAP_GROUP_WIDTH - 1));
+  if (map_match(group, MAP_CTRL_EMPTY)) {
+    m->ctrl[i] = MAP_CTRL_EMPTY;
+  } else {
+    m->ctrl[i] = MAP_CTRL_DELETED;
+    m->ndeleted++;
+  }
+  m->nnodes--;
+}
+
+static inline map_iter_t map_iter_(void) {
+  map_iter_t iter;
+  iter.bucketidx = -1;
+  return iter;
+}
+
+static inline void *map_iter_value_(map_base_t *m, map_iter_t *iter) {
+  map_slot_t *slot = &m->slots[iter->bucketidx];
+  return (char *)slot->key + slot->voffset;
+}
+
+static inline const char *map_next_(map_base_t *m, map_iter_t *iter) {
+  while (++iter->bucketidx < m->nslots) {
+    if (m->ctrl[iter->bucketidx] >= 0) return m->slots[iter->bucketidx].key;
+  }
+  return NULL;
+}
+
+#endif
@@ -1,288 +1,782 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
 #include "mapreduce.h"
+#include "map.h"
 
-struct map_node_t;
-typedef struct map_node_t map_node_t;
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
 
-typedef struct {
-  map_node_t **buckets;
-  unsigned nbuckets, nnodes;
-} map_base_t;
+#include "./mapreduce.h"
 
-typedef struct {
-  unsigned bucketidx;
-  map_node_t *node;
-} map_iter_t;
+#define INIT_MAX_RECORDS_PARTITION 2
+#define EMIT_BUFFER_BATCH 64
+#define SEGMENT_RECORDS 4096
+#define COMBINE_TABLE_MAX_KEYS 4096
+#define DEFAULT_ARENA_BLOCK_SIZE (64 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define KEY_PREFIX_BYTES 8
+#define RADIX_SORT_CUTOFF 32
+#define SPILL_IO_BUFFER_SIZE (1024 * 1024)
+#define SPILL_IO_BUFFER_MIN (16 * 1024)
+#define SPILL_MERGE_FAN_IN 16
+#define DEFAULT_INPUT_SPLIT_SIZE (32 * 1024 * 1024)
+#define DEFAULT_SAMPLE_SIZE (4 * 1024 * 1024)
+#define SAMPLE_WINDOWS_PER_INPUT 16
+#define SAMPLE_MAX_KEYS 65536
+#define INTERN_TABLE_INIT_SIZE 1024
+#define INTERN_CACHE_SIZE 256
+#define DEFAULT_STREAM_BATCH_BYTES (1024 * 1024)
+#define DEFAULT_STREAM_WINDOW_MS 100
+#define STREAM_READ_SIZE (64 * 1024)
+#define STREAM_MAX_PENDING_BATCHES 4
+#define MAX_NUMA_NODES 64
+#define SPLIT_MIN_RECORDS 4096
+#define MPOL_PREFERRED_MODE 1
+#define RECORD_OVERHEAD (2 * sizeof(char *) + 2 * sizeof(ulong) + 2 * sizeof(u_int32_t))
+
+// Phases timed for the job report, in wall time. Partitions are sorted by
+// the reducers as they go, so sorting is part of the reduce phase; the
+// report gives its CPU time summed over partitions on its own.
+#define PHASE_SETUP 0
+#define PHASE_MAP 1
+#define PHASE_REDUCE 2
+#define PHASE_TEARDOWN 3
+#define NUM_PHASES 4
 
-#define map_t(T)     \
-  struct {           \
-    map_base_t base; \
-    T *ref;          \
-    T tmp;           \
-  }
+typedef u_int64_t ulong;
 
-#define initialize_map(m) memset(m, 0, sizeof(*(m)))
+// Bump-pointer arena: blocks are only ever released all at once
+typedef struct __arena_block {
+  struct __arena_block *next;
+  size_t used;
+  size_t capacity;
+  size_t mapped_size;  // non-zero when the block came from mmap
+  char data[];
+} arena_block;
+
+typedef struct __arena {
+  arena_block *head;
+  int home_node;  // 1 + NUMA node new blocks are bound to, 0 for any
+} arena;
+
+// Intermediate records as parallel arrays; the prefix holds the first
+// KEY_PREFIX_BYTES of the key big-endian, so it orders like the key itself
+typedef struct __record_list {
+  char **keys;
+  char **values;
+  ulong *key_prefixes;
+  u_int32_t *key_lens;
+  ulong *key_hashes;
+  ulong size_of_list;
+  ulong next_to_fill;
+} record_list;
+
+// Sort key for one record, kept small so the radix passes stay in cache
+typedef struct __sort_entry {
+  ulong prefix;
+  u_int32_t idx;
+  u_int32_t len;
+} sort_entry;
+
+struct __merge_state;
+
+// Position of a reducer within the values of one key; spilled partitions
+// stream their values from a merge instead, and persisted partitions walk
+// the values laid out back to back in their mapping
+struct __MR_Cursor {
+  char **next;
+  char **end;
+  struct __merge_state *merge;
+  char *mapped;
+  ulong mapped_left;
+};
 
-#define destroy_map(m) destroy_map_(&(m)->base)
+// A sorted run spilled to a file, with the stdio buffer it was opened
+// with; level counts the merges that went into it
+typedef struct __spill_run {
+  FILE *file;
+  char *buffer;
+  int level;
+} spill_run;
+
+// One sorted input of the external merge: a spilled run file, or the
+// records still held in memory
+typedef struct __run_reader {
+  FILE *file;
+  record_list *list;
+  ulong pos;
+  char *key;
+  char *value;
+  u_int32_t key_len;
+  u_int32_t value_len;
+  char *buffer;
+  size_t capacity;
+  int done;
+} run_reader;
+
+// k-way merge over run readers; tree[0] is the winner, tree[1..k-1] the
+// losers of each match
+typedef struct __merge_state {
+  run_reader *readers;
+  int k;
+  int *tree;
+  char *key;
+  u_int32_t key_len;
+  size_t key_capacity;
+  arena values;
+} merge_state;
+
+// Persisted partition file, see MR_SetPersistDirectory. The header is
+// followed by every key as its u32 length, its bytes and a NUL, each
+// directly followed by its values in the same layout, which is the one
+// value_len expects; a mapping of the file hands them out as they are.
+// The index at index_offset holds one entry per key, sorted by key.
+typedef struct __persist_header {
+  char magic[8];
+  u_int64_t num_keys;
+  u_int64_t num_values;
+  u_int64_t index_offset;
+} persist_header;
+
+typedef struct __persist_entry {
+  u_int64_t key_offset;  // of the key's length
+  u_int64_t num_values;
+} persist_entry;
+
+typedef struct __persist_key {
+  persist_entry entry;
+  char *key;  // only needed when keys come unsorted
+  u_int32_t key_len;
+} persist_key;
+
+typedef struct __persist_writer {
+  FILE *file;
+  char *path;
+  u_int64_t offset;
+  u_int64_t num_values;
+  persist_key *keys;
+  ulong num_keys;
+  ulong capacity;
+} persist_writer;
+
+// Bytes one key and its values take up in a persisted partition
+typedef struct __persist_span {
+  u_int64_t start, end;
+} persist_span;
+
+typedef struct __output_buffer {
+  char *data;
+  size_t len;
+  size_t capacity;
+} output_buffer;
+
+// Fixed-size slice of a partition's records. Writers reserve slots with
+// a fetch-add on the partition and link new segments in with a CAS, so a
+// record is never moved once it has been written
+typedef struct __record_segment {
+  record_list records;
+  ulong base;  // partition slot of records.keys[0]
+  size_t mapped_size;  // non-zero when the segment was bound to a node
+  struct __record_segment *prev;
+  struct __record_segment *next;
+} record_segment;
+
+// One distinct key of a partition when keys are interned; records point
+// at key, so equal keys share one copy and one id
+typedef struct __intern_entry {
+  ulong hash;
+  u_int32_t id;
+  u_int32_t len;
+  char key[];
+} intern_entry;
+
+// Open addressing, slots are claimed with a CAS; inserts share the
+// resize lock and only a resize takes it exclusively
+typedef struct __intern_table {
+  intern_entry **slots;
+  ulong capacity;
+  ulong count;
+  u_int32_t next_id;
+  pthread_rwlock_t resize_lock;
+} intern_table;
+
+// Counters for the job report, kept apart from partition_data so they
+// outlive the partitions
+typedef struct __partition_stats {
+  ulong records;
+  ulong bytes;           // of the keys and values emitted
+  ulong resident_bytes;  // the same records as memory accounting sees them
+  ulong keys;
+  ulong lock_wait_ns;
+  ulong sort_ns;
+  ulong reduce_ns;
+} partition_stats;
 
-#define map_get(m, key) ((m)->ref = map_get_(&(m)->base, key))
+typedef struct __partition_data {
+  record_segment *segments;
+  record_segment *last_segment;  // hint, close to the newest segment
+  ulong reserved;
+  record_list records;  // segments gathered into one list for the reduce
+  ulong num_keys;
+  ulong *start_idxs;  
+  ulong *end_idxs;
+  MR_Cursor *cursors;
+  u_int32_t *group_table;  // key index + 1 by hash, with hash grouping
+  int group_bits;
+  char *mapped;  // persisted file being reduced instead of the records
+  size_t mapped_size;
+  persist_entry *mapped_index;
+  arena arena;
+  arena shared_arena;  // for emits from outside a mapper, under lock
+  size_t resident_bytes;
+  pthread_rwlock_t ingest_lock;  // only taken when spilling is enabled
+  pthread_mutex_t spill_lock;
+  spill_run *runs;
+  int num_runs;
+  output_buffer output;
+  sem_t sent_flag;
+  pthread_mutex_t lock;
+  intern_table interned;  // only used with key interning
+  partition_stats *stats;
+  int node;  // NUMA node of the reducers meant to take it, -1 for any
+  struct __reduce_slice *slices;  // key ranges, when split across reducers
+  int num_slices;
+  int next_slice;   // under the job's slice lock
+  int slices_left;  // not yet reduced
+  struct __partition_data *next_split;  // with slices left to claim
+} partition_data;
 
-#define map_set(m, key, value) \
-  ((m)->tmp = (value), map_set_(&(m)->base, key, &(m)->tmp, sizeof((m)->tmp)))
+typedef struct __combine_slot {
+  char *value;
+  size_t capacity;
+  ulong hash;
+} combine_slot;
+
+typedef map_t(combine_slot) map_combine_t;
+
+// Per-mapper staging area for one partition, flushed as a whole batch
+typedef struct __emit_buffer {
+  record_list records;
+  arena arena;
+  map_combine_t combined;
+  intern_entry **intern_cache;  // recently interned keys, by hash
+} emit_buffer;
+
+// Memory-mapped input file and one map task cut out of it
+typedef struct __input_map {
+  char *data;
+  size_t size;
+} input_map;
+
+typedef struct __input_chunk {
+  char *data;
+  size_t len;
+  int file_idx;
+} input_chunk;
+
+// Map tasks dealt to one mapper, largest first. head and tail share one
+// word so the owner (front) and thieves (back) claim tasks with a CAS.
+typedef struct __task_deque {
+  int *tasks;
+  u_int64_t ends;
+} task_deque;
+
+typedef struct __task_size {
+  size_t size;
+  int idx;
+} task_size;
+
+// Reduce output of one partition, kept in memory for the next round
+typedef struct __resident_table {
+  record_list records;
+  arena arena;
+} resident_table;
+
+// Key range of a split partition, reduced by whichever reducer claims it;
+// its output and results are put back in slice order
+typedef struct __reduce_slice {
+  int partition_idx;
+  ulong first_key;
+  ulong end_key;
+  output_buffer output;
+  resident_table results;
+} reduce_slice;
+
+// What a series of jobs (MR_RunIterative rounds, MR_RunStream batches)
+// carries from one job to the next
+typedef struct __mr_iteration {
+  RecordMapper record_map_function;
+  int num_partitions;
+  int round;
+  resident_table *inputs;   // kept by the previous round, mapped by this one
+  resident_table *outputs;  // filled by this round's reducers
+  char **range_splitters;   // sampled from the first job's input
+  int num_range_splitters;
+  partition_data **partition_data_list;  // emptied, not freed, between jobs
+} mr_iteration;
+
+// Lines read from a stream that no batch has taken yet
+typedef struct __stream_reader {
+  int fd;
+  char *data;
+  size_t len;
+  size_t capacity;
+  ulong first_byte_ns;  // arrival of the oldest pending byte
+  ulong last_read_ns;
+  int eof;
+  pthread_mutex_t lock;
+  pthread_cond_t arrived;
+  pthread_cond_t drained;
+} stream_reader;
+
+// Everything one MR_Run needs; workers find it through current_job, so
+// several jobs can share a context and run at the same time
+typedef struct __MR_Job {
+  Partitioner partition_function;
+  Reducer reduce_function;
+  Mapper map_function;
+  ChunkMapper chunk_map_function;
+  RecordMapper record_map_function;
+  Combiner combine_function;
+  int my_num_partitions;
+  int current_reduce_partition;
+  int affinity;
+  int *node_next_partition;  // per node, when reducers prefer their node
+  int *node_end_partition;
+  int split_partitions;
+  ulong split_records;  // partitions holding more get split
+  partition_data *split_head;  // partitions with slices left to claim
+  int partitions_unsorted;  // partitions that may still be split
+  pthread_mutex_t slice_lock;
+  pthread_cond_t slices_posted;
+  int reduce_mode;
+  int hash_grouping;
+  int intern_keys;
+  const char *persist_directory;  // where sorted partitions are written
+  const char *load_directory;     // where a reduce-only job reads them
+  size_t spill_budget;
+  size_t memory_budget;
+  size_t resident_bytes;  // records and arenas held by all partitions
+  size_t peak_resident_bytes;
+  int spills_running;  // under memory_lock
+  pthread_mutex_t memory_lock;
+  pthread_cond_t memory_freed;
+  int input_count;
+  char **input_args;
+  input_map *input_maps;
+  input_chunk *input_chunks;
+  resident_table *resident_inputs;
+  resident_table *resident_outputs;
+  int map_task_count;
+  char **sampled_keys;
+  ulong num_sampled_keys;
+  ulong num_keys_seen;
+  unsigned sample_seed;
+  arena sample_arena;
+  char **range_splitters;
+  int num_range_splitters;
+  task_deque *map_task_deques;
+  int *map_task_slots;
+  int num_map_deques;
+  partition_data **partition_data_list;
+  pthread_mutex_t current_partition_lock;
+  int num_mappers;
+  int num_reducers;
+  const char *report_path;
+  ulong phase_ns[NUM_PHASES];
+  ulong *mapper_busy_ns;
+  ulong *reducer_busy_ns;
+  partition_stats *partition_stats;
+  int pending_tasks;  // under the context lock
+  pthread_cond_t tasks_done;
+} mr_job;
+
+typedef struct __pool_task {
+  void (*run)(int idx);
+  mr_job *job;
+  int idx;
+  struct __pool_task *next;
+} pool_task;
+
+// Persistent worker pool; a job hands it one task per mapper, then one
+// per reducer, and waits for them
+struct __MR_Context {
+  pthread_t *threads;
+  int num_threads;
+  int num_started;  // workers that took their index
+  pool_task *head;
+  pool_task *tail;
+  int shutting_down;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+};
 
-#define delete_map_value(m, key) delete_map_value_(&(m)->base, key)
+int reduce_mode = MR_REDUCE_SERIAL;
+int hash_grouping = 0;
+int intern_keys = 0;
+int split_partitions = 1;
+int affinity_policy = MR_AFFINITY_NONE;
+size_t input_split_size = DEFAULT_INPUT_SPLIT_SIZE;
+size_t sample_size = DEFAULT_SAMPLE_SIZE;
+__thread mr_job *current_job = NULL;
+MR_Context *default_context = NULL;
+pthread_mutex_t default_context_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread emit_buffer *local_emit_buffers = NULL;
+__thread char *partition_key = NULL;  // terminated copy of a binary key
+__thread size_t partition_key_capacity = 0;
+__thread partition_data *reducing_partition = NULL;
+__thread output_buffer *reducing_output = NULL;
+__thread char *reducing_key = NULL;
+__thread size_t reducing_key_len = 0;
+__thread MR_Cursor *reducing_cursor = NULL;
+__thread resident_table *reducing_results = NULL;
+__thread mr_iteration *current_iteration = NULL;
+size_t arena_block_size = DEFAULT_ARENA_BLOCK_SIZE;
+int arena_huge_pages = 0;
+size_t spill_budget = 0;
+size_t memory_budget = 0;
+size_t stream_batch_bytes = DEFAULT_STREAM_BATCH_BYTES;
+int stream_window_ms = DEFAULT_STREAM_WINDOW_MS;
+BatchReporter batch_reporter = NULL;
+const char *spill_directory = NULL;
+const char *persist_directory = NULL;
+const char *report_path = NULL;
+
+// Write a JSON report of phase times, per-partition counters and worker
+// busy/idle time to path at the end of every job; NULL turns it off
+void MR_SetReportFile(const char *path) {
+  report_path = path;
+}
 
-#define map_iter(m) map_iter_()
+ulong now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ulong)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
-#define map_next(m, iter) map_next_(&(m)->base, iter)
+// CPU time of the calling thread, which leaves out time other threads
+// held the CPU while it was runnable
+ulong thread_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (ulong)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
-void destroy_map_(map_base_t *m);
-void *map_get_(map_base_t *m, const char *key);
-int map_set_(map_base_t *m, const char *key, void *value, int vsize);
-void delete_map_value_(map_base_t *m, const char *key);
-map_iter_t map_iter_(void);
-const char *map_next_(map_base_t *m, map_iter_t *iter);
+// Partition locks that charge the time spent waiting to the partition;
+// the clock is only read when the lock is contended
+void lock_partition_mutex(partition_data *partition, pthread_mutex_t *mutex) {
+  if (pthread_mutex_trylock(mutex) == 0) return;
+  ulong start = now_ns();
+  pthread_mutex_lock(mutex);
+  __atomic_add_fetch(&partition->stats->lock_wait_ns, now_ns() - start, __ATOMIC_RELAXED);
+}
 
-typedef map_t(void *) map_void_t;
-typedef map_t(char *) map_str_t;
-typedef map_t(int) map_int_t;
-typedef map_t(char) map_char_t;
-typedef map_t(float) map_float_t;
-typedef map_t(double) map_double_t;
+void lock_partition_rwlock(partition_data *partition, int exclusive) {
+  pthread_rwlock_t *rwlock = &partition->ingest_lock;
+  if ((exclusive ? pthread_rwlock_trywrlock(rwlock) : pthread_rwlock_tryrdlock(rwlock)) == 0) {
+    return;
+  }
+  ulong start = now_ns();
+  if (exclusive) {
+    pthread_rwlock_wrlock(rwlock);
+  } else {
+    pthread_rwlock_rdlock(rwlock);
+  }
+  __atomic_add_fetch(&partition->stats->lock_wait_ns, now_ns() - start, __ATOMIC_RELAXED);
+}
 
+// Spill a partition to a sorted run file once it holds more than
+// budget bytes; 0 keeps everything in memory
+void MR_SetSpillBudget(size_t budget) {
+  spill_budget = budget;
+}
 
-struct map_node_t {
-  unsigned hash;
-  void *value;
-  map_node_t *next;
-};
+// Cap the intermediate data held by all partitions of a job at budget
+// bytes; a mapper that pushes it over spills the largest partition, or
+// waits for running spills to free theirs. 0 turns it off
+void MR_SetMemoryBudget(size_t budget) {
+  memory_budget = budget;
+}
 
-static unsigned map_hash(const char *str) {
-    unsigned hash = 2166136261u;
-    while (*str) {
-        hash ^= (unsigned char)*str++;
-        hash *= 16777619;
-    }
-    return hash;
+// Intermediate bytes currently held in memory by the job the calling
+// mapper or reducer runs in; 0 outside a job
+size_t MR_GetResidentBytes() {
+  mr_job *job = current_job;
+  return job ? __atomic_load_n(&job->resident_bytes, __ATOMIC_RELAXED) : 0;
 }
 
+void MR_SetSpillDirectory(const char *directory) {
+  spill_directory = directory;
+}
 
-static map_node_t *map_newnode(const char *key, void *value, int vsize) {
-  map_node_t *node;
-  int ksize = strlen(key) + 1;
-  int voffset = ksize + ((sizeof(void *) - ksize) % sizeof(void *));
-  node = malloc(sizeof(*node) + voffset + vsize);
-  if (!node) return NULL;
+// Write every sorted partition of later jobs to directory as
+// partition-NNNNN.mrp, to be reduced again by MR_RunReduceOnly without
+// mapping; NULL turns it off. A series of jobs leaves the last job's files.
+void MR_SetPersistDirectory(const char *directory) {
+  persist_directory = directory;
+}
 
-  memcpy(node + 1, key, ksize);
-  node->hash = map_hash(key);
-  node->value = ((char *)(node + 1)) + voffset;
-  memcpy(node->value, value, vsize);
-  return node;
+void MR_SetArenaBlockSize(size_t block_size) {
+  arena_block_size = block_size > 0 ? block_size : DEFAULT_ARENA_BLOCK_SIZE;
 }
 
-static int map_bucketidx(map_base_t *m, unsigned hash) {
-  return hash & (m->nbuckets - 1);
+// Back arena blocks with transparent huge pages (blocks grow to 2MB)
+void MR_SetArenaHugePages(int enable) {
+  arena_huge_pages = enable;
 }
 
-static void map_addnode(map_base_t *m, map_node_t *node) {
-  int n = map_bucketidx(m, node->hash);
-  node->next = m->buckets[n];
-  m->buckets[n] = node;
+// CPUs this process may run on, grouped by NUMA node; nodes are numbered
+// 0..num_nodes-1 here and node_ids maps them back to the kernel's ids
+typedef struct __cpu_topology {
+  int num_nodes;
+  int node_ids[MAX_NUMA_NODES];
+  int node_first[MAX_NUMA_NODES];  // first of the node's CPUs in cpus
+  int node_cpus[MAX_NUMA_NODES];
+  int cpus[CPU_SETSIZE];
+  cpu_set_t allowed;
+} cpu_topology;
+
+cpu_topology topology;
+pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+__thread int worker_idx = -1;
+__thread int worker_node = -1;
+__thread int worker_affinity = MR_AFFINITY_NONE;
+
+// Pin pool workers to CPUs and bind partition storage to the NUMA node
+// of the reducers that will take it; see MR_AFFINITY_*
+void MR_SetAffinity(int policy) {
+  affinity_policy = policy;
 }
 
-static int map_resize(map_base_t *m, int nbuckets) {
-  map_node_t *nodes, *node, *next;
-  map_node_t **buckets;
-  int i;
-  nodes = NULL;
-  i = m->nbuckets;
-  while (i--) {
-    node = (m->buckets)[i];
-    while (node) {
-      next = node->next;
-      node->next = nodes;
-      nodes = node;
-      node = next;
-    }
-  }
-  buckets = realloc(m->buckets, sizeof(*m->buckets) * nbuckets);
-  if (buckets != NULL) {
-    m->buckets = buckets;
-    m->nbuckets = nbuckets;
+// Read the node of every allowed CPU from sysfs; without it all CPUs
+// count as one node
+void read_topology() {
+  int cpu_node[CPU_SETSIZE];
+  sched_getaffinity(0, sizeof(cpu_set_t), &topology.allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    cpu_node[cpu] = CPU_ISSET(cpu, &topology.allowed) ? 0 : -1;
   }
-  if (m->buckets) {
-    memset(m->buckets, 0, sizeof(*m->buckets) * m->nbuckets);
-    node = nodes;
-    while (node) {
-      next = node->next;
-      map_addnode(m, node);
-      node = next;
+  for (int node = 0; node < MAX_NUMA_NODES; node++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *list = fopen(path, "r");
+    if (!list) continue;
+    int first, last;
+    while (fscanf(list, "%d", &first) == 1) {
+      last = first;
+      int c = fgetc(list);
+      if (c == '-') {
+        if (fscanf(list, "%d", &last) != 1) break;
+        c = fgetc(list);
+      }
+      for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+        if (cpu_node[cpu] >= 0) cpu_node[cpu] = node;
+      }
+      if (c != ',') break;
     }
+    fclose(list);
   }
-  return (buckets == NULL) ? -1 : 0;
-}
 
-static map_node_t **map_getref(map_base_t *m, const char *key) {
-  unsigned hash = map_hash(key);
-  map_node_t **next;
-  if (m->nbuckets > 0) {
-    next = &m->buckets[map_bucketidx(m, hash)];
-    while (*next) {
-      if ((*next)->hash == hash && !strcmp((char *)(*next + 1), key)) {
-        return next;
-      }
-      next = &(*next)->next;
+  int num_cpus = 0;
+  for (int node = 0; node < MAX_NUMA_NODES; node++) {
+    int first = num_cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (cpu_node[cpu] == node) topology.cpus[num_cpus++] = cpu;
     }
+    if (num_cpus == first) continue;
+    int n = topology.num_nodes++;
+    topology.node_ids[n] = node;
+    topology.node_first[n] = first;
+    topology.node_cpus[n] = num_cpus - first;
   }
-  return NULL;
 }
 
-void destroy_map_(map_base_t *m) {
-  map_node_t *next, *node;
-  int i;
-  i = m->nbuckets;
-  while (i--) {
-    node = m->buckets[i];
-    while (node) {
-      next = node->next;
-      free(node);
-      node = next;
-    }
+// Apply the affinity policy of the job to the calling worker; pinning is
+// best effort, a CPU set the kernel refuses leaves the worker floating
+void pin_worker(int policy) {
+  pthread_once(&topology_once, read_topology);
+  cpu_set_t set = topology.allowed;
+  worker_node = -1;
+  if (policy == MR_AFFINITY_PINNED && topology.num_nodes > 0) {
+    int node = worker_idx % topology.num_nodes;
+    int cpu = topology.cpus[topology.node_first[node] +
+                            (worker_idx / topology.num_nodes) % topology.node_cpus[node]];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    worker_node = node;
   }
-  free(m->buckets);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+  worker_affinity = policy;
 }
 
-void *map_get_(map_base_t *m, const char *key) {
-  map_node_t **next = map_getref(m, key);
-  return next ? (*next)->value : NULL;
+// Ask for the pages of a fresh mapping to come from node; the kernel
+// falls back to other nodes when it is full
+void bind_to_node(void *mem, size_t len, int node) {
+#ifdef SYS_mbind
+  unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+  memset(mask, 0, sizeof(mask));
+  int id = topology.node_ids[node];
+  mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+  syscall(SYS_mbind, mem, len, MPOL_PREFERRED_MODE, mask, sizeof(mask) * 8 + 1, 0);
+#endif
 }
 
-int map_set_(map_base_t *m, const char *key, void *value, int vsize) {
-  int n, err;
-  map_node_t **next, *node;
-  
-  // Find the existing node
-  next = map_getref(m, key);
-  if (next) {
-    // Deallocate old node value if sizes differ (optional: based on actual need)
-    if (vsize != sizeof((*next)->value)) {
-        free((*next)->value);
-        (*next)->value = malloc(vsize);
+// Blocks bound to a node (node >= 0) are mapped on their own pages
+arena_block *arena_new_block(size_t min_capacity, int node) {
+  size_t capacity = arena_block_size;
+  if (capacity < min_capacity) capacity = min_capacity;
+  size_t total = sizeof(arena_block) + capacity;
+  arena_block *block = NULL;
+  size_t mapped_size = 0;
+
+  if (arena_huge_pages || node >= 0) {
+    size_t page = arena_huge_pages ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    mapped_size = (total + page - 1) & ~(page - 1);
+    void *mem = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+      if (arena_huge_pages) madvise(mem, mapped_size, MADV_HUGEPAGE);
+#endif
+      if (node >= 0) bind_to_node(mem, mapped_size, node);
+      block = mem;
+      capacity = mapped_size - sizeof(arena_block);
+    } else {
+      mapped_size = 0;
     }
-    // Replace the value in the existing node
-    memcpy((*next)->value, value, vsize);
-    return 0;
   }
-  
-  // Add new node
-  node = map_newnode(key, value, vsize);
-  if (node == NULL) goto fail;
-  if (m->nnodes >= m->nbuckets) {
-    n = (m->nbuckets > 0) ? (m->nbuckets << 1) : 1;
-    err = map_resize(m, n);
-    if (err) goto fail;
+  if (!block) {
+    block = malloc(total);
+    if (!block) {
+      fprintf(stderr, "Memory allocation failed for arena block\n");
+      exit(EXIT_FAILURE);
+    }
   }
-  map_addnode(m, node);
-  m->nnodes++;
-  return 0;
-
-fail:
-  if (node) free(node);
-  return -1;
+  block->next = NULL;
+  block->used = 0;
+  block->capacity = capacity;
+  block->mapped_size = mapped_size;
+  return block;
 }
 
-void delete_map_value_(map_base_t *m, const char *key) {
-  map_node_t *node;
-  map_node_t **next = map_getref(m, key);
-  if (next) {
-    node = *next;
-    *next = (*next)->next;
-    free(node);
-    m->nnodes--;
+void *arena_alloc(arena *a, size_t size) {
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  arena_block *block = a->head;
+  if (!block || block->capacity - block->used < size) {
+    block = arena_new_block(size, a->home_node - 1);
+    block->next = a->head;
+    a->head = block;
   }
+  void *ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
 }
 
-map_iter_t map_iter_(void) {
-  map_iter_t iter;
-  iter.bucketidx = -1;
-  iter.node = NULL;
-  return iter;
+// Move every block of src into dst; src is left empty
+void arena_splice(arena *dst, arena *src) {
+  arena_block *tail = src->head;
+  if (!tail) return;
+  while (tail->next) tail = tail->next;
+  tail->next = dst->head;
+  dst->head = src->head;
+  src->head = NULL;
 }
 
-const char *map_next_(map_base_t *m, map_iter_t *iter) {
-  if (iter->node) {
-    iter->node = iter->node->next;
-    if (iter->node == NULL) goto nextBucket;
-  } else {
-  nextBucket:
-    do {
-      if (++iter->bucketidx >= m->nbuckets) {
-        return NULL;
-      }
-      iter->node = m->buckets[iter->bucketidx];
-    } while (iter->node == NULL);
-  }
-  return (char *)(iter->node + 1);
+// Same as arena_splice, but safe against concurrent splices into dst
+void arena_splice_atomic(arena *dst, arena *src) {
+  arena_block *tail = src->head;
+  if (!tail) return;
+  while (tail->next) tail = tail->next;
+  arena_block *head = __atomic_load_n(&dst->head, __ATOMIC_RELAXED);
+  do {
+    tail->next = head;
+  } while (!__atomic_compare_exchange_n(&dst->head, &head, src->head, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  src->head = NULL;
 }
 
+void arena_release(arena *a);
 
-#include <pthread.h>
-#include <semaphore.h>
-#include <stdio.h>
-
-#include "./mapreduce.h"
-
-#define INIT_MAX_key_value_pair_PARTITION 2
-typedef u_int64_t ulong;
+// Drop everything but the newest block and start over at its beginning
+void arena_reset(arena *a) {
+  arena_block *head = a->head;
+  if (!head) return;
+  arena rest = {head->next, 0};
+  head->next = NULL;
+  head->used = 0;
+  arena_release(&rest);
+}
 
-typedef struct __key_value_pair {
-  char *key;
-  char *value;
-} key_value_pair;
+void arena_release(arena *a) {
+  arena_block *block = a->head;
+  while (block) {
+    arena_block *next = block->next;
+    if (block->mapped_size) {
+      munmap(block, block->mapped_size);
+    } else {
+      free(block);
+    }
+    block = next;
+  }
+  a->head = NULL;
+}
 
-typedef struct __partition_data {
-  key_value_pair **key_value_pair_list;
-  ulong size_of_list;
-  ulong next_to_fill;
-  ulong num_keys;
-  ulong *start_idxs;  
-  ulong *end_idxs;
-  ulong *cur_idxs;
-  ulong cur_key_idx;
-  map_int_t m;
-  sem_t sent_flag;
-  pthread_mutex_t lock;
-} partition_data;
+// 64-bit key hash (MurmurHash64A). MR_Emit computes it once per record and
+// reuses it for the default partitioner and for grouping.
+ulong key_hash(const char *key, size_t len) {
+  const ulong m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  const unsigned char *data = (const unsigned char *)key;
+  ulong hash = 0x8445d61a4e774912ULL ^ (len * m);
+
+  while (len >= 8) {
+    ulong k;
+    memcpy(&k, data, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    hash ^= k;
+    hash *= m;
+    data += 8;
+    len -= 8;
+  }
+  switch (len) {
+    case 7: hash ^= (ulong)data[6] << 48;  // fall through
+    case 6: hash ^= (ulong)data[5] << 40;  // fall through
+    case 5: hash ^= (ulong)data[4] << 32;  // fall through
+    case 4: hash ^= (ulong)data[3] << 24;  // fall through
+    case 3: hash ^= (ulong)data[2] << 16;  // fall through
+    case 2: hash ^= (ulong)data[1] << 8;   // fall through
+    case 1: hash ^= (ulong)data[0];
+            hash *= m;
+  }
+  hash ^= hash >> r;
+  hash *= m;
+  hash ^= hash >> r;
+  return hash;
+}
 
-typedef struct __arg_next {
-  int idx;
-  pthread_mutex_t lock;  
-} arg_next;
-
-Partitioner partition_function = NULL;
-Reducer reduce_function = NULL;
-Mapper map_function = NULL;
-int my_num_partitions = 0;
-int current_reduce_partition;
-int input_count = 0;
-char **input_args = NULL;
-arg_next my_arg_next;
-partition_data **partition_data_list = NULL;
-pthread_t *map_function_threads = NULL;
-pthread_t *my_reducer_threads = NULL;
-pthread_t *my_sort_threads = NULL;
-pthread_mutex_t current_partition_lock;
+ulong MR_KeyHash(char *key, size_t key_len) {
+  return key_hash(key, key_len);
+}
 
 ulong MR_DefaultHashPartition(char *key, int num_partitions) {
-  ulong hash = 5381;
-  int c;
-  while ((c = *key++) != '\0') hash = hash * 33 + c;
-  return hash % num_partitions;
+  return key_hash(key, strlen(key)) % num_partitions;
 }
 
 ulong MR_SortedPartition(char *key, int num_partitions) {
@@ -291,276 +785,3208 @@ ulong MR_SortedPartition(char *key, int num_partitions) {
   return assigned_partition;
 }
 
-void MR_Emit(char *key, char *value) {
-    ulong partition_num = partition_function(key, my_num_partitions);
-    partition_data *partition = partition_data_list[partition_num];
+// Range partition on splitters drawn from a sample of the inputs before
+// the map phase; keys keep their global order, and partitions come out
+// about equal in size
+ulong MR_SampledRangePartition(char *key, int num_partitions) {
+  mr_job *job = current_job;
+  // Outside a job (or before sampling) there are no splitters to use
+  if (job == NULL || job->num_range_splitters != num_partitions - 1) {
+    return MR_DefaultHashPartition(key, num_partitions);
+  }
+  int lo = 0, hi = job->num_range_splitters;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (strcmp(key, job->range_splitters[mid]) <= 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+ulong key_prefix(const char *key, size_t len) {
+    ulong prefix = 0;
+    for (size_t i = 0; i < KEY_PREFIX_BYTES; i++) {
+        prefix <<= 8;
+        if (i < len) prefix |= (unsigned char)key[i];
+    }
+    return prefix;
+}
 
-    pthread_mutex_lock(&partition->lock);
+void record_list_init(record_list *list, ulong size) {
+    list->size_of_list = size;
+    list->next_to_fill = 0;
+    list->keys = (char **)malloc(sizeof(char *) * size);
+    list->values = (char **)malloc(sizeof(char *) * size);
+    list->key_prefixes = (ulong *)malloc(sizeof(ulong) * size);
+    list->key_lens = (u_int32_t *)malloc(sizeof(u_int32_t) * size);
+    list->key_hashes = (ulong *)malloc(sizeof(ulong) * size);
+    if (!list->keys || !list->values || !list->key_prefixes || !list->key_lens ||
+        !list->key_hashes) {
+        fprintf(stderr, "Memory allocation failed for record_list\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    if (partition->next_to_fill == partition->size_of_list) {
-        partition->size_of_list *= 2;
+void record_list_destroy(record_list *list) {
+    free(list->keys);
+    free(list->values);
+    free(list->key_prefixes);
+    free(list->key_lens);
+    free(list->key_hashes);
+    memset(list, 0, sizeof(record_list));
+}
 
-        key_value_pair **new_key_value_pair_list = realloc(partition->key_value_pair_list, sizeof(key_value_pair *) * partition->size_of_list);
-        if (!new_key_value_pair_list) {
-            pthread_mutex_unlock(&partition->lock);
-            fprintf(stderr, "Memory allocation failed in MR_Emit\n");
-            exit(EXIT_FAILURE);
-        }
-        partition->key_value_pair_list = new_key_value_pair_list;
+#define GROW_ARRAY(ptr, size)                                        \
+  do {                                                               \
+    void *grown = realloc(ptr, sizeof(*(ptr)) * (size));             \
+    if (!grown) {                                                    \
+      fprintf(stderr, "Memory allocation failed for record_list\n"); \
+      exit(EXIT_FAILURE);                                            \
+    }                                                                \
+    ptr = grown;                                                     \
+  } while (0)
+
+void record_list_reserve(record_list *list, ulong count) {
+    if (list->next_to_fill + count <= list->size_of_list) return;
+    while (list->next_to_fill + count > list->size_of_list) {
+        list->size_of_list *= 2;
     }
+    GROW_ARRAY(list->keys, list->size_of_list);
+    GROW_ARRAY(list->values, list->size_of_list);
+    GROW_ARRAY(list->key_prefixes, list->size_of_list);
+    GROW_ARRAY(list->key_lens, list->size_of_list);
+    GROW_ARRAY(list->key_hashes, list->size_of_list);
+}
 
-    key_value_pair *new_pair = malloc(sizeof(key_value_pair));
-    if (!new_pair) {
-        pthread_mutex_unlock(&partition->lock);
-        fprintf(stderr, "Memory allocation failed for key_value_pair in MR_Emit\n");
-        exit(EXIT_FAILURE);
+// Values are stored right behind their length, so binary values keep
+// their size; both keys and values also get a NUL for string users
+u_int32_t value_len(const char *value) {
+    u_int32_t len;
+    memcpy(&len, value - sizeof(u_int32_t), sizeof(u_int32_t));
+    return len;
+}
+
+char *store_value(char *data, const char *value, u_int32_t len) {
+    memcpy(data, &len, sizeof(u_int32_t));
+    data += sizeof(u_int32_t);
+    memcpy(data, value, len);
+    data[len] = '\0';
+    return data;
+}
+
+// Copy key and value into one arena allocation and record them with the
+// key's length and hash; an interned key is referenced instead of copied.
+// The caller makes sure the list has room.
+void record_list_push(record_list *list, arena *a, char *key, size_t key_len,
+                      ulong hash, char *value, size_t len, intern_entry *interned) {
+    ulong i = list->next_to_fill++;
+    if (interned) {
+        char *data = arena_alloc(a, sizeof(u_int32_t) + len + 1);
+        list->keys[i] = interned->key;
+        list->values[i] = store_value(data, value, len);
+    } else {
+        size_t key_size = key_len + 1;
+        char *data = arena_alloc(a, key_size + sizeof(u_int32_t) + len + 1);
+        memcpy(data, key, key_len);
+        data[key_len] = '\0';
+        list->keys[i] = data;
+        list->values[i] = store_value(data + key_size, value, len);
     }
+    list->key_prefixes[i] = key_prefix(key, key_len);
+    list->key_lens[i] = key_len;
+    list->key_hashes[i] = hash;
+}
 
-    new_pair->key = strdup(key);
-    new_pair->value = strdup(value);
-    if (!new_pair->key || !new_pair->value) {
-        // Free allocated memory if any of strdup fails
-        if (new_pair->key) free(new_pair->key);
-        if (new_pair->value) free(new_pair->value);
-        free(new_pair);
-        pthread_mutex_unlock(&partition->lock);
-        fprintf(stderr, "Memory allocation failed for key/value in MR_Emit\n");
+void maybe_spill_partition(partition_data *partition);
+void apply_backpressure();
+
+void intern_table_init(intern_table *table) {
+    table->capacity = INTERN_TABLE_INIT_SIZE;
+    table->slots = (intern_entry **)calloc(table->capacity, sizeof(intern_entry *));
+    if (!table->slots) {
+        fprintf(stderr, "Memory allocation failed for intern table\n");
         exit(EXIT_FAILURE);
     }
+    table->count = 0;
+    table->next_id = 0;
+    pthread_rwlock_init(&table->resize_lock, NULL);
+}
 
-    partition->key_value_pair_list[partition->next_to_fill++] = new_pair;
+void intern_table_destroy(intern_table *table) {
+    if (!table->slots) return;
+    for (ulong i = 0; i < table->capacity; i++) {
+        free(table->slots[i]);
+    }
+    free(table->slots);
+    table->slots = NULL;
+    pthread_rwlock_destroy(&table->resize_lock);
+}
 
-    pthread_mutex_unlock(&partition->lock);
+intern_entry *intern_entry_of(char *key) {
+    return (intern_entry *)(key - offsetof(intern_entry, key));
 }
 
-void init_partition_data_list() {
-  partition_data_list =
-      (partition_data **)malloc(sizeof(partition_data *) * my_num_partitions);
-  for (int i = 0; i < my_num_partitions; i++) {
-    partition_data_list[i] = malloc(sizeof(partition_data));
-    pthread_mutex_init(&(partition_data_list[i]->lock), NULL);
-    partition_data_list[i]->size_of_list = INIT_MAX_key_value_pair_PARTITION;
-    partition_data_list[i]->key_value_pair_list =
-        (key_value_pair **)malloc(sizeof(key_value_pair *) * INIT_MAX_key_value_pair_PARTITION);
-    memset(partition_data_list[i]->key_value_pair_list, 0,
-           sizeof(key_value_pair *) * INIT_MAX_key_value_pair_PARTITION);
-    partition_data_list[i]->next_to_fill = 0;
-    sem_init(&partition_data_list[i]->sent_flag, 0, 0);
-  }
+int intern_entry_matches(intern_entry *entry, char *key, size_t key_len, ulong hash) {
+    return entry->hash == hash && entry->len == key_len && memcmp(entry->key, key, key_len) == 0;
 }
 
-void init_mapper_concurrency() {
-  my_arg_next.idx = 0;
-  pthread_mutex_init(&(my_arg_next.lock), NULL);
+void intern_table_grow(intern_table *table) {
+    pthread_rwlock_wrlock(&table->resize_lock);
+    if (table->count * 2 > table->capacity) {
+        ulong capacity = table->capacity * 2;
+        intern_entry **slots = (intern_entry **)calloc(capacity, sizeof(intern_entry *));
+        if (!slots) {
+            fprintf(stderr, "Memory allocation failed for intern table\n");
+            exit(EXIT_FAILURE);
+        }
+        for (ulong i = 0; i < table->capacity; i++) {
+            intern_entry *entry = table->slots[i];
+            if (!entry) continue;
+            ulong slot = (entry->hash >> 32) & (capacity - 1);
+            while (slots[slot]) slot = (slot + 1) & (capacity - 1);
+            slots[slot] = entry;
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+    pthread_rwlock_unlock(&table->resize_lock);
 }
 
-void init_reducer_concurrency() {
-  current_reduce_partition = 0;
-  pthread_mutex_init(&current_partition_lock, NULL);
+// Find or add key in the partition's table. A thread that loses the race
+// for a slot to the same key drops its entry, whose id then goes unused.
+intern_entry *intern_key(partition_data *partition, char *key, size_t key_len, ulong hash) {
+    intern_table *table = &partition->interned;
+    intern_entry *fresh = NULL, *found;
+    pthread_rwlock_rdlock(&table->resize_lock);
+    ulong mask = table->capacity - 1;
+    ulong slot = (hash >> 32) & mask;
+    while (1) {
+        intern_entry *entry = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+        if (!entry) {
+            if (!fresh) {
+                fresh = (intern_entry *)malloc(sizeof(intern_entry) + key_len + 1);
+                if (!fresh) {
+                    fprintf(stderr, "Memory allocation failed for interned key\n");
+                    exit(EXIT_FAILURE);
+                }
+                fresh->hash = hash;
+                fresh->len = key_len;
+                fresh->id = __atomic_fetch_add(&table->next_id, 1, __ATOMIC_RELAXED);
+                memcpy(fresh->key, key, key_len);
+                fresh->key[key_len] = '\0';
+                if (fresh->id == UINT32_MAX) {
+                    fprintf(stderr, "Too many distinct keys to intern\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (__atomic_compare_exchange_n(&table->slots[slot], &entry, fresh, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                found = fresh;
+                fresh = NULL;
+                __atomic_add_fetch(&table->count, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        if (intern_entry_matches(entry, key, key_len, hash)) {
+            found = entry;
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    int full = __atomic_load_n(&table->count, __ATOMIC_RELAXED) * 2 > table->capacity;
+    pthread_rwlock_unlock(&table->resize_lock);
+    free(fresh);
+    if (full) intern_table_grow(table);
+    return found;
 }
 
-void map_control() {
-  // each mapper take one of arguments, mutual exclusion here
-  int next_idx;
-  while (1) {
-    pthread_mutex_lock(&my_arg_next.lock);
-    next_idx = my_arg_next.idx;
-    my_arg_next.idx += 1;
-    if (next_idx >= input_count) {
-      pthread_mutex_unlock(&my_arg_next.lock);
-      break;
+// A segment bound to a node (node >= 0) is one mapping holding the
+// header and all five arrays
+record_segment *new_record_segment(ulong base, record_segment *prev, int node) {
+    record_segment *segment;
+    if (node >= 0) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = sizeof(record_segment) +
+                      SEGMENT_RECORDS * (2 * sizeof(char *) + 2 * sizeof(ulong) + sizeof(u_int32_t));
+        size = (size + page - 1) & ~(page - 1);
+        char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Memory allocation failed for record segment\n");
+            exit(EXIT_FAILURE);
+        }
+        bind_to_node(mem, size, node);
+        segment = (record_segment *)mem;
+        record_list *list = &segment->records;
+        char *arrays = mem + sizeof(record_segment);
+        list->keys = (char **)arrays;
+        list->values = list->keys + SEGMENT_RECORDS;
+        list->key_prefixes = (ulong *)(list->values + SEGMENT_RECORDS);
+        list->key_hashes = list->key_prefixes + SEGMENT_RECORDS;
+        list->key_lens = (u_int32_t *)(list->key_hashes + SEGMENT_RECORDS);
+        list->size_of_list = SEGMENT_RECORDS;
+        list->next_to_fill = 0;
+        segment->mapped_size = size;
+    } else {
+        segment = malloc(sizeof(record_segment));
+        if (!segment) {
+            fprintf(stderr, "Memory allocation failed for record segment\n");
+            exit(EXIT_FAILURE);
+        }
+        record_list_init(&segment->records, SEGMENT_RECORDS);
+        segment->mapped_size = 0;
     }
-    pthread_mutex_unlock(&my_arg_next.lock);
-    map_function(input_args[next_idx]);
-  }
+    segment->base = base;
+    segment->prev = prev;
+    segment->next = NULL;
+    return segment;
 }
 
-int key_value_pair_comparator(const void *pair1, const void *pair2) {
-  key_value_pair **p1 = (key_value_pair **)pair1;
-  key_value_pair **p2 = (key_value_pair **)pair2;
-  return strcmp((*p1)->key, (*p2)->key);
+void free_record_segments(record_segment *segment) {
+    while (segment) {
+        record_segment *next = segment->next;
+        if (segment->mapped_size) {
+            munmap(segment, segment->mapped_size);
+        } else {
+            record_list_destroy(&segment->records);
+            free(segment);
+        }
+        segment = next;
+    }
 }
 
-void sort_partition(int partition_idx) {
-    partition_data *partition = partition_data_list[partition_idx];
-    
-    // Sort key-value pairs
-    qsort(partition->key_value_pair_list, partition->next_to_fill, sizeof(key_value_pair *),
-          key_value_pair_comparator);
+// Find the segment holding a reserved slot, linking in new segments as
+// needed; losing the CAS only means another writer linked it first
+record_segment *segment_for_slot(partition_data *partition, ulong slot) {
+    record_segment *segment = __atomic_load_n(&partition->last_segment, __ATOMIC_ACQUIRE);
+    while (segment->base > slot) segment = segment->prev;
+    while (slot >= segment->base + SEGMENT_RECORDS) {
+        record_segment *next = __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE);
+        if (!next) {
+            record_segment *fresh = new_record_segment(segment->base + SEGMENT_RECORDS, segment,
+                                                       partition->node);
+            if (__atomic_compare_exchange_n(&segment->next, &next, fresh, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                next = fresh;
+            } else {
+                free_record_segments(fresh);
+            }
+        }
+        segment = next;
+    }
+    record_segment *last = __atomic_load_n(&partition->last_segment, __ATOMIC_ACQUIRE);
+    while (last->base < segment->base &&
+           !__atomic_compare_exchange_n(&partition->last_segment, &last, segment, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+    return segment;
+}
 
-    ulong num_keys = 0;
-    char *key_tmp = NULL;
-    char *key_cmp = NULL;
+// Writers share the ingest lock so a spill can take the records and the
+// arena away while nobody is copying into them; without a spill budget
+// or memory budget there is nothing to exclude and appends take no lock
+void begin_ingest(partition_data *partition) {
+    mr_job *job = current_job;
+    if (job->spill_budget || job->memory_budget) lock_partition_rwlock(partition, 0);
+}
 
-    // Count unique keys
-    for (size_t i = 0; i < partition->next_to_fill; i++) {
-        key_cmp = partition->key_value_pair_list[i]->key;
-        if (key_tmp == NULL || strcmp(key_cmp, key_tmp) != 0) {
-            num_keys++;
-            key_tmp = key_cmp;
+void end_ingest(partition_data *partition) {
+    mr_job *job = current_job;
+    if (job->spill_budget || job->memory_budget) pthread_rwlock_unlock(&partition->ingest_lock);
+}
+
+// Append a batch of records to a partition; the caller is inside
+// begin_ingest, concurrent appends only meet on the slot counter
+void append_records(partition_data *partition, record_list *batch) {
+    ulong count = batch->next_to_fill;
+    size_t emitted = 0;
+    for (ulong i = 0; i < count; i++) {
+        emitted += batch->key_lens[i] + value_len(batch->values[i]);
+    }
+    size_t bytes = emitted + count * (2 + RECORD_OVERHEAD);
+
+    ulong start = __atomic_fetch_add(&partition->reserved, count, __ATOMIC_RELAXED);
+    for (ulong done = 0; done < count;) {
+        record_segment *segment = segment_for_slot(partition, start + done);
+        ulong at = start + done - segment->base;
+        ulong n = count - done;
+        if (n > SEGMENT_RECORDS - at) n = SEGMENT_RECORDS - at;
+        record_list *list = &segment->records;
+        memcpy(list->keys + at, batch->keys + done, sizeof(char *) * n);
+        memcpy(list->values + at, batch->values + done, sizeof(char *) * n);
+        memcpy(list->key_prefixes + at, batch->key_prefixes + done, sizeof(ulong) * n);
+        memcpy(list->key_lens + at, batch->key_lens + done, sizeof(u_int32_t) * n);
+        memcpy(list->key_hashes + at, batch->key_hashes + done, sizeof(ulong) * n);
+        done += n;
+    }
+    __atomic_add_fetch(&partition->resident_bytes, bytes, __ATOMIC_RELAXED);
+    mr_job *job = current_job;
+    size_t resident = __atomic_add_fetch(&job->resident_bytes, bytes, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&job->peak_resident_bytes, __ATOMIC_RELAXED);
+    while (resident > peak && !__atomic_compare_exchange_n(&job->peak_resident_bytes, &peak,
+                                                           resident, 1, __ATOMIC_RELAXED,
+                                                           __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&partition->stats->records, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&partition->stats->bytes, emitted, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&partition->stats->resident_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Detach every segment of a partition and copy them into one list; the
+// caller makes sure nobody is appending
+void gather_segments(partition_data *partition, record_list *list) {
+    ulong count = partition->reserved;
+    record_list_init(list, count > 0 ? count : INIT_MAX_RECORDS_PARTITION);
+    for (record_segment *segment = partition->segments; segment && segment->base < count;
+         segment = segment->next) {
+        ulong n = count - segment->base;
+        if (n > SEGMENT_RECORDS) n = SEGMENT_RECORDS;
+        record_list *from = &segment->records;
+        memcpy(list->keys + segment->base, from->keys, sizeof(char *) * n);
+        memcpy(list->values + segment->base, from->values, sizeof(char *) * n);
+        memcpy(list->key_prefixes + segment->base, from->key_prefixes, sizeof(ulong) * n);
+        memcpy(list->key_lens + segment->base, from->key_lens, sizeof(u_int32_t) * n);
+        memcpy(list->key_hashes + segment->base, from->key_hashes, sizeof(ulong) * n);
+    }
+    list->next_to_fill = count;
+    free_record_segments(partition->segments);
+    partition->segments = new_record_segment(0, NULL, partition->node);
+    partition->last_segment = partition->segments;
+    partition->reserved = 0;
+}
+
+void flush_emit_buffer(int partition_num) {
+    emit_buffer *buffer = &local_emit_buffers[partition_num];
+    if (buffer->records.next_to_fill == 0) return;
+    partition_data *partition = current_job->partition_data_list[partition_num];
+    begin_ingest(partition);
+    append_records(partition, &buffer->records);
+    // Every record in the older blocks is flushed now, so the partition
+    // may own (and free on spill) all but the block still being filled
+    arena_block *head = buffer->arena.head;
+    if (head && head->next) {
+        arena retired = {head->next, 0};
+        head->next = NULL;
+        arena_splice_atomic(&partition->arena, &retired);
+    }
+    end_ingest(partition);
+    buffer->records.next_to_fill = 0;
+    maybe_spill_partition(partition);
+    apply_backpressure();
+}
+
+// Stage one record in the mapper's buffer, flushing when it fills up
+void buffer_emit(int partition_num, char *key, size_t key_len, ulong hash, char *value,
+                 size_t len) {
+    emit_buffer *buffer = &local_emit_buffers[partition_num];
+    intern_entry *interned = NULL;
+    if (current_job->intern_keys) {
+        // Repeated keys are found in the mapper's cache without touching
+        // the shared table
+        intern_entry **cached = &buffer->intern_cache[(hash >> 32) & (INTERN_CACHE_SIZE - 1)];
+        if (!*cached || !intern_entry_matches(*cached, key, key_len, hash)) {
+            *cached = intern_key(current_job->partition_data_list[partition_num], key, key_len, hash);
         }
+        interned = *cached;
     }
-    
-    // Allocate memory for index arrays
-    partition->num_keys = num_keys;
-    partition->start_idxs = (ulong *)malloc(sizeof(ulong) * num_keys);
-    partition->end_idxs = (ulong *)malloc(sizeof(ulong) * num_keys);
-    partition->cur_idxs = (ulong *)malloc(sizeof(ulong) * num_keys);
+    record_list_push(&buffer->records, &buffer->arena, key, key_len, hash, value, len, interned);
+    if (buffer->records.next_to_fill == EMIT_BUFFER_BATCH) {
+        flush_emit_buffer(partition_num);
+    }
+}
 
-    if (!partition->start_idxs || !partition->end_idxs || !partition->cur_idxs) {
-        fprintf(stderr, "Memory allocation failed in sort_partition\n");
+void combine_slot_store(combine_slot *slot, char *value) {
+    size_t size = strlen(value) + 1;
+    if (value == slot->value) return;
+    if (size > slot->capacity) {
+        size_t capacity = slot->capacity * 2;
+        if (capacity < size) capacity = size;
+        char *new_value = malloc(capacity);
+        if (!new_value) {
+            fprintf(stderr, "Memory allocation failed for combined value in MR_Emit\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(new_value, value, size);
+        free(slot->value);
+        slot->value = new_value;
+        slot->capacity = capacity;
+    } else {
+        memmove(slot->value, value, size);
+    }
+}
+
+// Push every combined pair of one partition into its emit buffer
+void flush_combine_table(int partition_num) {
+    emit_buffer *buffer = &local_emit_buffers[partition_num];
+    map_iter_t iter = map_iter(&buffer->combined);
+    const char *key;
+    while ((key = map_next(&buffer->combined, &iter))) {
+        combine_slot *slot = map_iter_value(&buffer->combined, &iter);
+        buffer_emit(partition_num, (char *)key, strlen(key), slot->hash, slot->value,
+                    strlen(slot->value));
+        free(slot->value);
+    }
+    clear_map(&buffer->combined);
+}
+
+// The table reuses the record hash; its high half, as the low half is
+// what picked the partition
+#define COMBINE_HASH(hash) ((unsigned)((hash) >> 32))
+
+void combine_emit(int partition_num, char *key, ulong hash, char *value) {
+    emit_buffer *buffer = &local_emit_buffers[partition_num];
+    combine_slot *slot = map_get_hashed(&buffer->combined, key, COMBINE_HASH(hash));
+    if (slot) {
+        combine_slot_store(slot, current_job->combine_function(key, slot->value, value));
+        return;
+    }
+
+    combine_slot new_slot = {NULL, 0, hash};
+    combine_slot_store(&new_slot, value);
+    if (map_set_hashed(&buffer->combined, key, COMBINE_HASH(hash), new_slot) != 0) {
+        fprintf(stderr, "Memory allocation failed for combine table in MR_Emit\n");
         exit(EXIT_FAILURE);
     }
+    if (buffer->combined.base.nnodes >= COMBINE_TABLE_MAX_KEYS) {
+        flush_combine_table(partition_num);
+    }
+}
 
-    // Initialize the map and index arrays
-    initialize_map(&partition->m);
-    int cur_key_idx = -1;
-    key_tmp = NULL;
+void sample_key(char *key, size_t key_len);
 
-    for (size_t i = 0; i < partition->next_to_fill; i++) {
-        key_cmp = partition->key_value_pair_list[i]->key;
+// Shared by MR_Emit and MR_EmitBytes; only string values go through the
+// combiner, which works on C strings
+void emit_record(char *key, size_t key_len, char *value, size_t len, int combine) {
+    if (!current_job) {
+        fprintf(stderr, "MR_Emit called outside a job; see MR_AttachJob\n");
+        exit(EXIT_FAILURE);
+    }
 
-        if (key_tmp == NULL || strcmp(key_cmp, key_tmp) != 0) {
-            if (cur_key_idx > -1 && cur_key_idx < num_keys) {
-                partition->end_idxs[cur_key_idx] = i;
-            }
-            cur_key_idx++;
-            if (cur_key_idx >= num_keys) {
-                fprintf(stderr, "Index out-of-bounds in sort_partition\n");
+    mr_job *job = current_job;
+    // The sampling pass only collects keys
+    if (job->sampled_keys) {
+        sample_key(key, key_len);
+        return;
+    }
+
+    ulong hash = key_hash(key, key_len);
+    ulong partition_num;
+    if (job->partition_function == MR_DefaultHashPartition) {
+        partition_num = hash % job->my_num_partitions;
+    } else if (combine) {
+        partition_num = job->partition_function(key, job->my_num_partitions);
+    } else {
+        // Partitioners expect a C string, binary keys are not terminated
+        if (key_len + 1 > partition_key_capacity) {
+            size_t capacity = partition_key_capacity ? partition_key_capacity : 64;
+            while (capacity < key_len + 1) capacity *= 2;
+            char *scratch = realloc(partition_key, capacity);
+            if (!scratch) {
+                fprintf(stderr, "Memory allocation failed in MR_EmitBytes\n");
                 exit(EXIT_FAILURE);
             }
-            partition->start_idxs[cur_key_idx] = i;
-            map_set(&partition->m, key_cmp, cur_key_idx);
-            partition->cur_idxs[cur_key_idx] = i;
-            key_tmp = key_cmp;
+            partition_key = scratch;
+            partition_key_capacity = capacity;
         }
+        memcpy(partition_key, key, key_len);
+        partition_key[key_len] = '\0';
+        partition_num = job->partition_function(partition_key, job->my_num_partitions);
     }
 
-    // Finalize the last key's end index
-    if (cur_key_idx >= 0 && cur_key_idx < num_keys) {
-        partition->end_idxs[cur_key_idx] = partition->next_to_fill;
+    // Emits from outside a mapper thread have no local buffer, go straight in
+    if (!local_emit_buffers) {
+        partition_data *partition = job->partition_data_list[partition_num];
+        char *keys[1], *values[1];
+        ulong prefixes[1], hashes[1];
+        u_int32_t lens[1];
+        record_list single = {keys, values, prefixes, lens, hashes, 1, 0};
+        begin_ingest(partition);
+        lock_partition_mutex(partition, &partition->lock);
+        intern_entry *interned =
+            job->intern_keys ? intern_key(partition, key, key_len, hash) : NULL;
+        record_list_push(&single, &partition->shared_arena, key, key_len, hash, value, len,
+                         interned);
+        pthread_mutex_unlock(&partition->lock);
+        append_records(partition, &single);
+        end_ingest(partition);
+        maybe_spill_partition(partition);
+        apply_backpressure();
+        return;
+    }
+
+    if (combine && job->combine_function) {
+        combine_emit(partition_num, key, hash, value);
+        return;
     }
 
-    partition->cur_key_idx = 0;
+    buffer_emit(partition_num, key, key_len, hash, value, len);
 }
 
+MR_Job *MR_CurrentJob(void) {
+    return current_job;
+}
 
-char *Get(char *key, int num_partition) {
-  partition_data *partition = partition_data_list[num_partition];
-  int key_idx = *map_get(&partition->m, key);
-  ulong cur_key_value_pair_idx = partition->cur_idxs[key_idx];
-  ulong end_idx = partition->end_idxs[key_idx];
-  if (cur_key_value_pair_idx >= end_idx) {
-    return NULL;
-  } else {
-    partition->cur_idxs[key_idx]++;
-    return partition->key_value_pair_list[cur_key_value_pair_idx]->value;
-  }
+// The job lives until MR_Run returns, which waits for its mappers; a
+// thread must detach before the mapper that attached it returns
+void MR_AttachJob(MR_Job *job) {
+    current_job = job;
 }
 
-void reduce_controller() {
-  int partition_to_reduce = -1;
+void MR_Emit(char *key, char *value) {
+    emit_record(key, strlen(key), value, strlen(value), 1);
+}
 
-  while (1) {
-    pthread_mutex_lock(&current_partition_lock);
-    partition_to_reduce = current_reduce_partition;
-    if (partition_to_reduce >= my_num_partitions) {
-      pthread_mutex_unlock(&current_partition_lock);
-      break;
+// Emit key_len bytes of key with len bytes of value; neither needs to be
+// a C string. Reducers get the value length from MR_GetBytes and the key
+// length from MR_KeyLength. These pairs skip the combiner.
+void MR_EmitBytes(char *key, size_t key_len, void *value, size_t len) {
+    if (key_len > UINT32_MAX || len > UINT32_MAX) {
+        fprintf(stderr, "Key or value too large for MR_EmitBytes\n");
+        exit(EXIT_FAILURE);
     }
-    current_reduce_partition++;
-    pthread_mutex_unlock(&current_partition_lock);
+    emit_record(key, key_len, (char *)value, len, 0);
+}
 
-    partition_data *partition = partition_data_list[partition_to_reduce];
-    sort_partition(partition_to_reduce);
-    if (partition_to_reduce > 0) {
-      sem_wait(&partition_data_list[partition_to_reduce - 1]->sent_flag);
-    }
+// A long travels as its 8 bytes instead of a formatted string
+void MR_EmitLong(char *key, long value) {
+    MR_EmitBytes(key, strlen(key), &value, sizeof(long));
+}
 
-    for (size_t i = 0; i < partition->num_keys; i++) {
-      ulong key_value_pair_idx = partition->start_idxs[i];
-      char *key = partition->key_value_pair_list[key_value_pair_idx]->key;
-      reduce_function(key, Get, partition_to_reduce);
-      sem_post(&partition->sent_flag);
-    }
-    if (partition->num_keys == 0) {
-      sem_post(&partition->sent_flag);
-    }
+// Point empty partitions, new or kept from the previous job of a series,
+// at the settings and counters of the current job
+void attach_partition_data_list() {
+  mr_job *job = current_job;
+  int num_nodes = 0;
+  if (job->affinity == MR_AFFINITY_PINNED) {
+    pthread_once(&topology_once, read_topology);
+    num_nodes = topology.num_nodes;
+  }
+  for (int i = 0; i < job->my_num_partitions; i++) {
+    partition_data *partition = job->partition_data_list[i];
+    partition->stats = &job->partition_stats[i];
+    // Contiguous blocks of partitions per node; one node needs no binding
+    partition->node = num_nodes > 1 ? (int)((long)i * num_nodes / job->my_num_partitions) : -1;
+    partition->shared_arena.home_node = partition->node + 1;
+    if (job->intern_keys) intern_table_init(&partition->interned);
   }
 }
 
-void destruct_partition_data_list() {
-  if (!partition_data_list) return; 
-
-  for (size_t i = 0; i < my_num_partitions; i++) {
-    partition_data *partition = partition_data_list[i];
-    if (!partition) continue; 
-    if (partition->key_value_pair_list) {
-      for (size_t j = 0; j < partition->next_to_fill; j++) {
-        key_value_pair *kv_pair = partition->key_value_pair_list[j];
-        if (kv_pair) {
-          free(kv_pair->key);   
-          free(kv_pair->value); 
-          free(kv_pair);       
+void init_partition_data_list() {
+  mr_job *job = current_job;
+  job->partition_data_list =
+      (partition_data **)malloc(sizeof(partition_data *) * job->my_num_partitions);
+  for (int i = 0; i < job->my_num_partitions; i++) {
+    partition_data *partition = malloc(sizeof(partition_data));
+    job->partition_data_list[i] = partition;
+    pthread_mutex_init(&partition->lock, NULL);
+    pthread_rwlock_init(&partition->ingest_lock, NULL);
+    pthread_mutex_init(&partition->spill_lock, NULL);
+    partition->node = -1;
+    partition->segments = new_record_segment(0, NULL, -1);
+    partition->last_segment = partition->segments;
+    partition->reserved = 0;
+    memset(&partition->records, 0, sizeof(record_list));
+    partition->num_keys = 0;
+    partition->start_idxs = NULL;
+    partition->end_idxs = NULL;
+    partition->cursors = NULL;
+    partition->group_table = NULL;
+    partition->group_bits = 0;
+    partition->mapped = NULL;
+    partition->mapped_size = 0;
+    partition->mapped_index = NULL;
+    partition->slices = NULL;
+    partition->num_slices = 0;
+    partition->resident_bytes = 0;
+    partition->runs = NULL;
+    partition->num_runs = 0;
+    memset(&partition->arena, 0, sizeof(arena));
+    memset(&partition->shared_arena, 0, sizeof(arena));
+    memset(&partition->output, 0, sizeof(output_buffer));
+    sem_init(&partition->sent_flag, 0, 0);
+    memset(&partition->interned, 0, sizeof(intern_table));
+  }
+  attach_partition_data_list();
+}
+
+void MR_SetInputSplitSize(size_t split_size) {
+  input_split_size = split_size > 0 ? split_size : DEFAULT_INPUT_SPLIT_SIZE;
+}
+
+// Map every input and cut it into chunks of about input_split_size bytes
+// that end on a newline
+void split_inputs() {
+  mr_job *job = current_job;
+  int capacity = job->input_count > 0 ? job->input_count : 1;
+  job->input_maps = (input_map *)calloc(capacity, sizeof(input_map));
+  job->input_chunks = (input_chunk *)malloc(sizeof(input_chunk) * capacity);
+  if (!job->input_maps || !job->input_chunks) {
+    fprintf(stderr, "Memory allocation failed for input chunks\n");
+    exit(EXIT_FAILURE);
+  }
+  job->map_task_count = 0;
+
+  for (int i = 0; i < job->input_count; i++) {
+    int fd = open(job->input_args[i], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr, "Cannot open input %s\n", job->input_args[i]);
+      exit(EXIT_FAILURE);
+    }
+    if (st.st_size == 0) {
+      close(fd);
+      continue;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Cannot map input %s\n", job->input_args[i]);
+      exit(EXIT_FAILURE);
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    job->input_maps[i].data = data;
+    job->input_maps[i].size = st.st_size;
+
+    size_t offset = 0;
+    while (offset < job->input_maps[i].size) {
+      size_t end = offset + input_split_size;
+      if (end >= job->input_maps[i].size) {
+        end = job->input_maps[i].size;
+      } else {
+        char *newline = memchr(data + end, '\n', job->input_maps[i].size - end);
+        end = newline ? (size_t)(newline - data) + 1 : job->input_maps[i].size;
+      }
+      if (job->map_task_count == capacity) {
+        capacity *= 2;
+        input_chunk *chunks = realloc(job->input_chunks, sizeof(input_chunk) * capacity);
+        if (!chunks) {
+          fprintf(stderr, "Memory allocation failed for input chunks\n");
+          exit(EXIT_FAILURE);
         }
+        job->input_chunks = chunks;
       }
-      free(partition->key_value_pair_list); 
+      job->input_chunks[job->map_task_count].data = data + offset;
+      job->input_chunks[job->map_task_count].len = end - offset;
+      job->input_chunks[job->map_task_count].file_idx = i;
+      job->map_task_count++;
+      offset = end;
+    }
+  }
+}
+
+void destruct_inputs() {
+  mr_job *job = current_job;
+  if (job->input_maps) {
+    for (int i = 0; i < job->input_count; i++) {
+      if (job->input_maps[i].data) munmap(job->input_maps[i].data, job->input_maps[i].size);
+    }
+  }
+  free(job->input_maps);
+  free(job->input_chunks);
+  job->input_maps = NULL;
+  job->input_chunks = NULL;
+}
+
+// A map task is a whole input file, one chunk of it when splitting, or
+// one partition of the previous round's output in an iterative job
+void run_map_task(int task_idx) {
+  mr_job *job = current_job;
+  if (job->resident_inputs) {
+    record_list *records = &job->resident_inputs[task_idx].records;
+    for (ulong i = 0; i < records->next_to_fill; i++) {
+      job->record_map_function(records->keys[i], records->key_lens[i], records->values[i],
+                               value_len(records->values[i]), task_idx);
     }
+  } else if (job->chunk_map_function) {
+    input_chunk *chunk = &job->input_chunks[task_idx];
+    job->chunk_map_function(chunk->data, chunk->len, job->input_args[chunk->file_idx]);
+  } else {
+    job->map_function(job->input_args[task_idx]);
+  }
+}
 
-    free(partition->start_idxs); 
-    free(partition->end_idxs);   
-    free(partition->cur_idxs);  
+int task_size_comparator(const void *size1, const void *size2) {
+  const task_size *t1 = (const task_size *)size1;
+  const task_size *t2 = (const task_size *)size2;
+  if (t1->size != t2->size) return t1->size > t2->size ? -1 : 1;
+  return t1->idx - t2->idx;
+}
 
-    destroy_map(&partition->m);  
+// Deal tasks largest-first round-robin over one deque per mapper, so the
+// big inputs start early instead of trailing at the end of argv
+void init_mapper_concurrency(int num_mappers) {
+  mr_job *job = current_job;
+  task_size *sizes = (task_size *)malloc(sizeof(task_size) * (job->map_task_count + 1));
+  job->map_task_slots = (int *)malloc(sizeof(int) * (job->map_task_count + 1));
+  job->map_task_deques = (task_deque *)malloc(sizeof(task_deque) * num_mappers);
+  if (!sizes || !job->map_task_slots || !job->map_task_deques) {
+    fprintf(stderr, "Memory allocation failed for map task deques\n");
+    exit(EXIT_FAILURE);
+  }
+  job->num_map_deques = num_mappers;
+
+  for (int i = 0; i < job->map_task_count; i++) {
+    struct stat st;
+    sizes[i].idx = i;
+    if (job->resident_inputs) {
+      sizes[i].size = job->resident_inputs[i].records.next_to_fill;
+    } else if (job->chunk_map_function) {
+      sizes[i].size = job->input_chunks[i].len;
+    } else {
+      sizes[i].size = stat(job->input_args[i], &st) == 0 ? (size_t)st.st_size : 0;
+    }
+  }
+  qsort(sizes, job->map_task_count, sizeof(task_size), task_size_comparator);
 
-    pthread_mutex_destroy(&partition->lock); 
-    sem_destroy(&partition->sent_flag);     
-    free(partition);                         
+  int slot = 0;
+  for (int d = 0; d < num_mappers; d++) {
+    job->map_task_deques[d].tasks = job->map_task_slots + slot;
+    for (int i = d; i < job->map_task_count; i += num_mappers) {
+      job->map_task_slots[slot++] = sizes[i].idx;
+    }
+    job->map_task_deques[d].ends = slot - (job->map_task_deques[d].tasks - job->map_task_slots);
   }
+  free(sizes);
+}
 
-  free(partition_data_list); 
-  partition_data_list = NULL; 
+void destruct_mapper_concurrency() {
+  mr_job *job = current_job;
+  free(job->map_task_deques);
+  free(job->map_task_slots);
+  job->map_task_deques = NULL;
+  job->map_task_slots = NULL;
+}
+
+// Claim the front (owner) or back (thief) task of a deque; -1 when empty
+int task_deque_take(task_deque *deque, int from_back) {
+  u_int64_t ends = __atomic_load_n(&deque->ends, __ATOMIC_ACQUIRE);
+  while (1) {
+    u_int32_t head = ends >> 32;
+    u_int32_t tail = (u_int32_t)ends;
+    if (head >= tail) return -1;
+    u_int64_t next = from_back ? ((u_int64_t)head << 32) | (tail - 1)
+                               : ((u_int64_t)(head + 1) << 32) | tail;
+    if (__atomic_compare_exchange_n(&deque->ends, &ends, next, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return deque->tasks[from_back ? tail - 1 : head];
+    }
+  }
 }
 
+// Nothing is pushed once mapping starts, so one pass over empty deques
+// means the map phase is out of work
+int next_map_task(int mapper_idx) {
+  mr_job *job = current_job;
+  int task = task_deque_take(&job->map_task_deques[mapper_idx], 0);
+  for (int i = 1; task < 0 && i < job->num_map_deques; i++) {
+    task = task_deque_take(&job->map_task_deques[(mapper_idx + i) % job->num_map_deques], 1);
+  }
+  return task;
+}
 
-void MR_Run(int argc, char *argv[], Mapper map, int num_mappers, Reducer reduce,
-            int num_reducers, Partitioner partition, int num_partitions) {
-  partition_function = partition;
-  my_num_partitions = num_partitions;
-  map_function = map;
-  reduce_function = reduce;
-  input_count = argc - 1;
-  input_args = argv + sizeof(char);
-  init_partition_data_list();
-  map_function_threads = (pthread_t *)malloc(num_mappers * sizeof(pthread_t));
-  if (!map_function_threads) {
-    fprintf(stderr, "Memory allocation failed for map_function_threads\n");
-    exit(EXIT_FAILURE);
+// Pinned reducers first take the partitions bound to their own node. Not
+// in serial mode: a reducer there waits for the partition before its own,
+// which must not sit behind another node's backlog.
+void init_reducer_concurrency() {
+  mr_job *job = current_job;
+  job->current_reduce_partition = 0;
+  pthread_mutex_init(&job->current_partition_lock, NULL);
+  pthread_mutex_init(&job->slice_lock, NULL);
+  pthread_cond_init(&job->slices_posted, NULL);
+  job->split_head = NULL;
+  job->partitions_unsorted = job->my_num_partitions;
+  // Serial mode chains partitions through their output, and one reducer
+  // has nobody to share with
+  job->split_partitions = split_partitions && job->num_reducers > 1 &&
+                          job->reduce_mode != MR_REDUCE_SERIAL;
+  ulong total = 0;
+  for (int i = 0; i < job->my_num_partitions; i++) {
+    total += job->partition_data_list[i]->reserved;
+  }
+  job->split_records = total / job->num_reducers;
+  if (job->my_num_partitions == 0 || job->partition_data_list[0]->node < 0 ||
+      job->reduce_mode == MR_REDUCE_SERIAL) {
+    return;
   }
-  my_reducer_threads = (pthread_t *)malloc(num_reducers * sizeof(pthread_t));
-  if (!my_reducer_threads) {
-    free(map_function_threads);
-    fprintf(stderr, "Memory allocation failed for my_reducer_threads\n");
+  job->node_next_partition = (int *)malloc(sizeof(int) * topology.num_nodes);
+  job->node_end_partition = (int *)malloc(sizeof(int) * topology.num_nodes);
+  if (!job->node_next_partition || !job->node_end_partition) {
+    fprintf(stderr, "Memory allocation failed for reducer nodes\n");
     exit(EXIT_FAILURE);
   }
-  init_mapper_concurrency();
-  for (int i = 0; i < num_mappers; i++) {
-    pthread_create(&map_function_threads[i], NULL, (void *)&map_control, NULL);
+  for (int node = 0; node < topology.num_nodes; node++) {
+    job->node_next_partition[node] = job->my_num_partitions;
+    job->node_end_partition[node] = job->my_num_partitions;
   }
-  for (int i = 0; i < num_mappers; i++) {
-    pthread_join(map_function_threads[i], NULL);
+  for (int i = job->my_num_partitions - 1; i >= 0; i--) {
+    int node = job->partition_data_list[i]->node;
+    job->node_next_partition[node] = i;
+    if (i == job->my_num_partitions - 1 || job->partition_data_list[i + 1]->node != node) {
+      job->node_end_partition[node] = i + 1;
+    }
   }
+}
 
-  for (int i = 0; i < num_reducers; i++) {
-    pthread_create(&my_reducer_threads[i], NULL, (void *)&reduce_controller,
-                   NULL);
+void destruct_reducer_concurrency() {
+  mr_job *job = current_job;
+  pthread_mutex_destroy(&job->current_partition_lock);
+  pthread_mutex_destroy(&job->slice_lock);
+  pthread_cond_destroy(&job->slices_posted);
+  free(job->node_next_partition);
+  free(job->node_end_partition);
+  job->node_next_partition = NULL;
+  job->node_end_partition = NULL;
+}
+
+// Next partition to reduce, -1 when all are taken
+int next_reduce_partition() {
+  mr_job *job = current_job;
+  int partition = -1;
+  pthread_mutex_lock(&job->current_partition_lock);
+  if (job->node_next_partition) {
+    int num_nodes = topology.num_nodes;
+    int home = worker_node >= 0 ? worker_node : 0;
+    for (int i = 0; i < num_nodes && partition < 0; i++) {
+      int node = (home + i) % num_nodes;
+      if (job->node_next_partition[node] < job->node_end_partition[node]) {
+        partition = job->node_next_partition[node]++;
+      }
+    }
+  } else if (job->current_reduce_partition < job->my_num_partitions) {
+    partition = job->current_reduce_partition++;
   }
-  for (int i = 0; i < num_reducers; i++) {
-    pthread_join(my_reducer_threads[i], NULL);
+  pthread_mutex_unlock(&job->current_partition_lock);
+  return partition;
+}
+
+void map_control(int mapper_idx) {
+  mr_job *job = current_job;
+  // each mapper drains its own deque, then steals from the others
+  int next_idx;
+  ulong start = now_ns();
+  local_emit_buffers = (emit_buffer *)calloc(job->my_num_partitions, sizeof(emit_buffer));
+  if (!local_emit_buffers) {
+    fprintf(stderr, "Memory allocation failed for local_emit_buffers\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < job->my_num_partitions; i++) {
+    record_list_init(&local_emit_buffers[i].records, EMIT_BUFFER_BATCH);
+    local_emit_buffers[i].arena.home_node = job->partition_data_list[i]->node + 1;
+    if (job->intern_keys) {
+      local_emit_buffers[i].intern_cache =
+          (intern_entry **)calloc(INTERN_CACHE_SIZE, sizeof(intern_entry *));
+      if (!local_emit_buffers[i].intern_cache) {
+        fprintf(stderr, "Memory allocation failed for local_emit_buffers\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  while ((next_idx = next_map_task(mapper_idx)) >= 0) {
+    run_map_task(next_idx);
+  }
+  for (int i = 0; i < job->my_num_partitions; i++) {
+    flush_combine_table(i);
+    flush_emit_buffer(i);
+    // Hand the arena over, it is released with the partition in MR_Run
+    partition_data *partition = job->partition_data_list[i];
+    begin_ingest(partition);
+    arena_splice_atomic(&partition->arena, &local_emit_buffers[i].arena);
+    end_ingest(partition);
+    record_list_destroy(&local_emit_buffers[i].records);
+    destroy_map(&local_emit_buffers[i].combined);
+    free(local_emit_buffers[i].intern_cache);
+  }
+  free(local_emit_buffers);
+  local_emit_buffers = NULL;
+  free(partition_key);
+  partition_key = NULL;
+  partition_key_capacity = 0;
+  job->mapper_busy_ns[mapper_idx] = now_ns() - start;
+}
+
+__thread record_list *sorting_records = NULL;
+
+// Key order for entries that share their first depth bytes, with prefix
+// holding the KEY_PREFIX_BYTES that follow
+int compare_entries_at(const sort_entry *e1, const sort_entry *e2, u_int32_t depth) {
+  if (e1->prefix != e2->prefix) return e1->prefix < e2->prefix ? -1 : 1;
+  u_int32_t min_len = e1->len < e2->len ? e1->len : e2->len;
+  if (min_len > depth + KEY_PREFIX_BYTES) {
+    int cmp = memcmp(sorting_records->keys[e1->idx] + depth + KEY_PREFIX_BYTES,
+                     sorting_records->keys[e2->idx] + depth + KEY_PREFIX_BYTES,
+                     min_len - depth - KEY_PREFIX_BYTES);
+    if (cmp != 0) return cmp;
+  }
+  return (e1->len > e2->len) - (e1->len < e2->len);
+}
+
+void insertion_sort_entries(sort_entry *entries, ulong n, u_int32_t depth) {
+  for (ulong i = 1; i < n; i++) {
+    sort_entry entry = entries[i];
+    ulong j = i;
+    while (j > 0 && compare_entries_at(&entry, &entries[j - 1], depth) < 0) {
+      entries[j] = entries[j - 1];
+      j--;
+    }
+    entries[j] = entry;
+  }
+}
+
+// MSD radix sort on the key prefix, one byte per level. Groups that still
+// tie after all prefix bytes reload the prefix from the next key bytes,
+// so full keys are only compared inside small buckets.
+void radix_sort_entries(sort_entry *entries, sort_entry *tmp, ulong n, int byte,
+                        u_int32_t depth) {
+  if (n <= RADIX_SORT_CUTOFF) {
+    insertion_sort_entries(entries, n, depth);
+    return;
+  }
+  if (byte == KEY_PREFIX_BYTES) {
+    int longer = 0;
+    depth += KEY_PREFIX_BYTES;
+    for (ulong i = 0; i < n; i++) {
+      u_int32_t len = entries[i].len;
+      entries[i].prefix = len > depth
+          ? key_prefix(sorting_records->keys[entries[i].idx] + depth, len - depth)
+          : 0;
+      if (len > depth) longer = 1;
+    }
+    // Identical up to their length; only keys with embedded NULs differ
+    if (!longer) {
+      insertion_sort_entries(entries, n, depth);
+      return;
+    }
+    byte = 0;
+  }
+
+  int shift = 8 * (KEY_PREFIX_BYTES - 1 - byte);
+  ulong counts[256] = {0};
+  for (ulong i = 0; i < n; i++) {
+    counts[(entries[i].prefix >> shift) & 0xff]++;
+  }
+
+  ulong offsets[256];
+  ulong offset = 0;
+  for (int b = 0; b < 256; b++) {
+    offsets[b] = offset;
+    offset += counts[b];
+  }
+  if (counts[(entries[0].prefix >> shift) & 0xff] != n) {
+    for (ulong i = 0; i < n; i++) {
+      tmp[offsets[(entries[i].prefix >> shift) & 0xff]++] = entries[i];
+    }
+    memcpy(entries, tmp, sizeof(sort_entry) * n);
+  }
+
+  offset = 0;
+  for (int b = 0; b < 256; b++) {
+    if (counts[b] > 1) {
+      radix_sort_entries(entries + offset, tmp, counts[b], byte + 1, depth);
+    }
+    offset += counts[b];
+  }
+}
+
+#define PERMUTE_ARRAY(type, field)                                   \
+  do {                                                               \
+    type *sorted = (type *)malloc(sizeof(type) * n);                 \
+    if (!sorted) {                                                   \
+      fprintf(stderr, "Memory allocation failed in sort_partition\n"); \
+      exit(EXIT_FAILURE);                                            \
+    }                                                                \
+    for (ulong i = 0; i < n; i++) sorted[i] = list->field[entries[i].idx]; \
+    free(list->field);                                               \
+    list->field = sorted;                                            \
+  } while (0)
+
+void sort_records(record_list *list) {
+  ulong n = list->next_to_fill;
+  if (n > UINT32_MAX) {
+    fprintf(stderr, "Partition too large to sort in sort_partition\n");
+    exit(EXIT_FAILURE);
+  }
+  sort_entry *entries = (sort_entry *)malloc(sizeof(sort_entry) * (n + 1));
+  sort_entry *tmp = (sort_entry *)malloc(sizeof(sort_entry) * (n + 1));
+  if (!entries || !tmp) {
+    fprintf(stderr, "Memory allocation failed in sort_partition\n");
+    exit(EXIT_FAILURE);
+  }
+  for (ulong i = 0; i < n; i++) {
+    entries[i].prefix = list->key_prefixes[i];
+    entries[i].idx = i;
+    entries[i].len = list->key_lens[i];
+  }
+
+  sorting_records = list;
+  radix_sort_entries(entries, tmp, n, 0, 0);
+  sorting_records = NULL;
+  free(tmp);
+
+  PERMUTE_ARRAY(char *, keys);
+  PERMUTE_ARRAY(char *, values);
+  PERMUTE_ARRAY(ulong, key_prefixes);
+  PERMUTE_ARRAY(u_int32_t, key_lens);
+  PERMUTE_ARRAY(ulong, key_hashes);
+  list->size_of_list = n;
+  free(entries);
+}
+
+// Neighbouring records in sorted order; cheap fields are checked first
+int same_key(record_list *list, ulong a, ulong b) {
+  if (list->keys[a] == list->keys[b]) return 1;
+  if (list->key_prefixes[a] != list->key_prefixes[b] ||
+      list->key_lens[a] != list->key_lens[b] ||
+      list->key_hashes[a] != list->key_hashes[b]) {
+    return 0;
+  }
+  if (list->key_lens[a] <= KEY_PREFIX_BYTES) return 1;
+  return memcmp(list->keys[a] + KEY_PREFIX_BYTES, list->keys[b] + KEY_PREFIX_BYTES,
+                list->key_lens[a] - KEY_PREFIX_BYTES) == 0;
+}
+
+// Group the records of a partition without sorting: one pass over an
+// open-addressing table on the stored key hashes numbers the groups, a
+// counting pass then moves each group together. Groups come out in the
+// order their keys were first seen, and the table stays for find_cursor.
+void group_records(partition_data *partition) {
+  record_list *list = &partition->records;
+  ulong n = list->next_to_fill;
+  if (n > UINT32_MAX / 2) {
+    fprintf(stderr, "Partition too large to group in sort_partition\n");
+    exit(EXIT_FAILURE);
+  }
+  int bits = 4;
+  while ((1UL << bits) < 2 * n) bits++;
+  ulong mask = (1UL << bits) - 1;
+  u_int32_t *table = (u_int32_t *)calloc(mask + 1, sizeof(u_int32_t));
+  u_int32_t *groups = (u_int32_t *)malloc(sizeof(u_int32_t) * (n + 1));
+  ulong *firsts = (ulong *)malloc(sizeof(ulong) * (n + 1));
+  ulong *offsets = (ulong *)calloc(n + 1, sizeof(ulong));
+  sort_entry *entries = (sort_entry *)malloc(sizeof(sort_entry) * (n + 1));
+  if (!table || !groups || !firsts || !offsets || !entries) {
+    fprintf(stderr, "Memory allocation failed in sort_partition\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Probe on the high hash bits, the low ones picked the partition
+  ulong num_groups = 0;
+  for (ulong i = 0; i < n; i++) {
+    ulong slot = list->key_hashes[i] >> (64 - bits);
+    while (table[slot] && !same_key(list, firsts[table[slot] - 1], i)) {
+      slot = (slot + 1) & mask;
+    }
+    if (!table[slot]) {
+      firsts[num_groups] = i;
+      table[slot] = ++num_groups;
+    }
+    groups[i] = table[slot] - 1;
+    offsets[groups[i]]++;
+  }
+
+  ulong total = 0;
+  for (ulong g = 0; g < num_groups; g++) {
+    ulong count = offsets[g];
+    offsets[g] = total;
+    total += count;
+  }
+  for (ulong i = 0; i < n; i++) {
+    entries[offsets[groups[i]]++].idx = i;
+  }
+  free(groups);
+  free(firsts);
+  free(offsets);
+
+  PERMUTE_ARRAY(char *, keys);
+  PERMUTE_ARRAY(char *, values);
+  PERMUTE_ARRAY(ulong, key_prefixes);
+  PERMUTE_ARRAY(u_int32_t, key_lens);
+  PERMUTE_ARRAY(ulong, key_hashes);
+  list->size_of_list = n;
+  free(entries);
+
+  partition->group_table = table;
+  partition->group_bits = bits;
+}
+
+int compare_keys(const char *key1, u_int32_t len1, const char *key2, u_int32_t len2);
+
+int intern_entry_comparator(const void *entry1, const void *entry2) {
+  const intern_entry *e1 = *(intern_entry *const *)entry1;
+  const intern_entry *e2 = *(intern_entry *const *)entry2;
+  return compare_keys(e1->key, e1->len, e2->key, e2->len);
+}
+
+// With interned keys only the distinct keys are sorted; the records are
+// then placed by a counting sort on their key's id, so grouping never
+// compares key bytes. Hash grouping gains nothing here and is ignored.
+void sort_interned_records(partition_data *partition) {
+  intern_table *table = &partition->interned;
+  record_list *list = &partition->records;
+  ulong n = list->next_to_fill;
+  intern_entry **distinct = (intern_entry **)malloc(sizeof(intern_entry *) * (table->count + 1));
+  ulong *offsets = (ulong *)calloc((ulong)table->next_id + 1, sizeof(ulong));
+  sort_entry *entries = (sort_entry *)malloc(sizeof(sort_entry) * (n + 1));
+  if (!distinct || !offsets || !entries) {
+    fprintf(stderr, "Memory allocation failed in sort_partition\n");
+    exit(EXIT_FAILURE);
+  }
+  ulong num_distinct = 0;
+  for (ulong i = 0; i < table->capacity; i++) {
+    if (table->slots[i]) distinct[num_distinct++] = table->slots[i];
+  }
+  qsort(distinct, num_distinct, sizeof(intern_entry *), intern_entry_comparator);
+
+  for (ulong i = 0; i < n; i++) {
+    offsets[intern_entry_of(list->keys[i])->id]++;
+  }
+  ulong total = 0;
+  for (ulong r = 0; r < num_distinct; r++) {
+    ulong id = distinct[r]->id;
+    ulong count = offsets[id];
+    offsets[id] = total;
+    total += count;
+  }
+  for (ulong i = 0; i < n; i++) {
+    entries[offsets[intern_entry_of(list->keys[i])->id]++].idx = i;
+  }
+  free(distinct);
+  free(offsets);
+
+  PERMUTE_ARRAY(char *, keys);
+  PERMUTE_ARRAY(char *, values);
+  PERMUTE_ARRAY(ulong, key_prefixes);
+  PERMUTE_ARRAY(u_int32_t, key_lens);
+  PERMUTE_ARRAY(ulong, key_hashes);
+  list->size_of_list = n;
+  free(entries);
+}
+
+void sort_partition(int partition_idx) {
+    mr_job *job = current_job;
+    partition_data *partition = job->partition_data_list[partition_idx];
+    record_list *list = &partition->records;
+    
+    if (job->intern_keys) {
+        sort_interned_records(partition);
+    } else if (job->hash_grouping) {
+        group_records(partition);
+    } else {
+        sort_records(list);
+    }
+
+    ulong num_keys = 0;
+
+    // Count unique keys
+    for (size_t i = 0; i < list->next_to_fill; i++) {
+        if (i == 0 || !same_key(list, i - 1, i)) {
+            num_keys++;
+        }
+    }
+    
+    // Allocate memory for index arrays
+    partition->num_keys = num_keys;
+    partition->start_idxs = (ulong *)malloc(sizeof(ulong) * num_keys);
+    partition->end_idxs = (ulong *)malloc(sizeof(ulong) * num_keys);
+    partition->cursors = (MR_Cursor *)malloc(sizeof(MR_Cursor) * num_keys);
+
+    if (!partition->start_idxs || !partition->end_idxs || !partition->cursors) {
+        fprintf(stderr, "Memory allocation failed in sort_partition\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize the index arrays
+    ulong cur_key_idx = 0;
+    for (size_t i = 0; i < list->next_to_fill; i++) {
+        if (i > 0 && same_key(list, i - 1, i)) continue;
+        if (i > 0) {
+            partition->end_idxs[cur_key_idx++] = i;
+        }
+        partition->start_idxs[cur_key_idx] = i;
+    }
+
+    // Finalize the last key's end index
+    if (num_keys > 0) {
+        partition->end_idxs[cur_key_idx] = list->next_to_fill;
+    }
+
+    for (ulong k = 0; k < num_keys; k++) {
+        partition->cursors[k].next = list->values + partition->start_idxs[k];
+        partition->cursors[k].end = list->values + partition->end_idxs[k];
+        partition->cursors[k].merge = NULL;
+        partition->cursors[k].mapped = NULL;
+        partition->cursors[k].mapped_left = 0;
+    }
+}
+
+
+// Create a uniquely named file in the spill directory; *path is malloc'd
+int create_temp_file(const char *prefix, char **path) {
+  const char *directory = spill_directory;
+  if (!directory) directory = getenv("TMPDIR");
+  if (!directory) directory = "/tmp";
+  size_t len = strlen(directory) + strlen(prefix) + sizeof("/-XXXXXX");
+  *path = malloc(len);
+  if (!*path) {
+    fprintf(stderr, "Memory allocation failed for temp file name\n");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(*path, len, "%s/%s-XXXXXX", directory, prefix);
+  int fd = mkstemp(*path);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create temp file in %s\n", directory);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+// A merge holds up to SPILL_MERGE_FAN_IN run buffers at once, so they
+// get a share of the budget that makes partitions spill
+size_t spill_buffer_size() {
+  mr_job *job = current_job;
+  size_t budget = job->spill_budget;
+  if (job->memory_budget && (!budget || job->memory_budget < budget)) {
+    budget = job->memory_budget;
+  }
+  size_t size = budget / SPILL_MERGE_FAN_IN;
+  if (size < SPILL_IO_BUFFER_MIN) return SPILL_IO_BUFFER_MIN;
+  if (size > SPILL_IO_BUFFER_SIZE) return SPILL_IO_BUFFER_SIZE;
+  return size;
+}
+
+void open_spill_run(spill_run *run) {
+  char *path;
+  int fd = create_temp_file("mr-spill", &path);
+  // The run lives only as long as its descriptor
+  unlink(path);
+  free(path);
+  size_t size = spill_buffer_size();
+  run->file = fdopen(fd, "w+");
+  run->buffer = malloc(size);
+  run->level = 0;
+  if (!run->file || !run->buffer) {
+    fprintf(stderr, "Cannot open spill file\n");
+    exit(EXIT_FAILURE);
+  }
+  setvbuf(run->file, run->buffer, _IOFBF, size);
+}
+
+void close_spill_run(spill_run *run) {
+  fclose(run->file);
+  free(run->buffer);
+}
+
+void write_spill_record(spill_run *run, char *key, u_int32_t key_len, char *value,
+                        u_int32_t len) {
+  u_int32_t lens[2] = {key_len, len};
+  if (fwrite(lens, sizeof(lens), 1, run->file) != 1 ||
+      fwrite(key, 1, key_len, run->file) != key_len ||
+      fwrite(value, 1, len, run->file) != len) {
+    fprintf(stderr, "Write failed for spill file\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Flush a written run and rewind it for the merge
+void finish_spill_run(spill_run *run) {
+  if (fflush(run->file) != 0 || fseek(run->file, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Write failed for spill file\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Sort records and write them as a run of length-prefixed keys and values
+void write_spill_run(record_list *list, spill_run *run) {
+  open_spill_run(run);
+  sort_records(list);
+  for (ulong i = 0; i < list->next_to_fill; i++) {
+    write_spill_record(run, list->keys[i], list->key_lens[i], list->values[i],
+                       value_len(list->values[i]));
+  }
+  finish_spill_run(run);
+}
+
+void merge_init_runs(merge_state *merge, spill_run *runs, int num_runs, record_list *list);
+void merge_destroy(merge_state *merge);
+run_reader *merge_top(merge_state *merge);
+void loser_tree_next(merge_state *merge);
+
+// Replace runs [first, num_runs) of partition by their merge. The merge
+// is stable, so each key keeps its values in emit order. Only the thread
+// holding spill_lock, or the partition's reducer, changes the runs
+void merge_spill_runs(partition_data *partition, int first) {
+  merge_state merge;
+  spill_run merged;
+  merge_init_runs(&merge, partition->runs + first, partition->num_runs - first, NULL);
+  open_spill_run(&merged);
+  run_reader *top;
+  while ((top = merge_top(&merge))) {
+    write_spill_record(&merged, top->key, top->key_len, top->value, top->value_len);
+    loser_tree_next(&merge);
+  }
+  finish_spill_run(&merged);
+  merge_destroy(&merge);
+
+  lock_partition_mutex(partition, &partition->lock);
+  for (int i = first; i < partition->num_runs; i++) {
+    if (partition->runs[i].level >= merged.level) merged.level = partition->runs[i].level + 1;
+    close_spill_run(&partition->runs[i]);
+  }
+  partition->runs[first] = merged;
+  partition->num_runs = first + 1;
+  pthread_mutex_unlock(&partition->lock);
+}
+
+// Whenever the newest SPILL_MERGE_FAN_IN runs are of one level they are
+// merged into one run a level up, which keeps the open runs, and their
+// buffers, logarithmic in the amount spilled
+void compact_spill_runs(partition_data *partition) {
+  while (partition->num_runs >= SPILL_MERGE_FAN_IN) {
+    int first = partition->num_runs - SPILL_MERGE_FAN_IN;
+    if (partition->runs[first].level != partition->runs[partition->num_runs - 1].level) break;
+    merge_spill_runs(partition, first);
+  }
+}
+
+// Take the partition's records and arena out from under the lock, so the
+// sort and the write do not block other mappers. Returns 0 when the
+// partition holds no more than threshold bytes or is already spilling
+int spill_partition(partition_data *partition, size_t threshold) {
+  mr_job *job = current_job;
+  if (__atomic_load_n(&partition->resident_bytes, __ATOMIC_RELAXED) <= threshold) return 0;
+  // One spill at a time per partition: a later spill may release arena
+  // blocks that the records of an earlier, still writing, spill point into
+  if (pthread_mutex_trylock(&partition->spill_lock) != 0) return 0;
+  lock_partition_rwlock(partition, 1);
+  if (partition->resident_bytes <= threshold || partition->reserved == 0) {
+    pthread_rwlock_unlock(&partition->ingest_lock);
+    pthread_mutex_unlock(&partition->spill_lock);
+    return 0;
+  }
+  pthread_mutex_lock(&job->memory_lock);
+  job->spills_running++;
+  pthread_mutex_unlock(&job->memory_lock);
+  record_list list;
+  gather_segments(partition, &list);
+  arena spilled = partition->arena;
+  partition->arena.head = NULL;
+  lock_partition_mutex(partition, &partition->lock);
+  arena_splice(&spilled, &partition->shared_arena);
+  pthread_mutex_unlock(&partition->lock);
+  size_t freed = partition->resident_bytes;
+  __atomic_store_n(&partition->resident_bytes, 0, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&partition->ingest_lock);
+
+  spill_run run;
+  write_spill_run(&list, &run);
+  record_list_destroy(&list);
+  arena_release(&spilled);
+
+  lock_partition_mutex(partition, &partition->lock);
+  spill_run *runs = realloc(partition->runs, sizeof(spill_run) * (partition->num_runs + 1));
+  if (!runs) {
+    pthread_mutex_unlock(&partition->lock);
+    fprintf(stderr, "Memory allocation failed for spill runs\n");
+    exit(EXIT_FAILURE);
+  }
+  partition->runs = runs;
+  partition->runs[partition->num_runs++] = run;
+  pthread_mutex_unlock(&partition->lock);
+  compact_spill_runs(partition);
+  pthread_mutex_unlock(&partition->spill_lock);
+
+  // The memory is only back once the run is written and the arena freed
+  pthread_mutex_lock(&job->memory_lock);
+  __atomic_sub_fetch(&job->resident_bytes, freed, __ATOMIC_RELAXED);
+  job->spills_running--;
+  pthread_cond_broadcast(&job->memory_freed);
+  pthread_mutex_unlock(&job->memory_lock);
+  return 1;
+}
+
+void maybe_spill_partition(partition_data *partition) {
+  mr_job *job = current_job;
+  if (job->spill_budget == 0) return;
+  spill_partition(partition, job->spill_budget);
+}
+
+// Called by a mapper after each flush: while the job is over its memory
+// budget, spill the largest partition, and when every candidate is
+// already being spilled by another mapper, wait for one of those to end
+void apply_backpressure() {
+  mr_job *job = current_job;
+  if (job->memory_budget == 0) return;
+  while (__atomic_load_n(&job->resident_bytes, __ATOMIC_RELAXED) > job->memory_budget) {
+    partition_data *largest = NULL;
+    size_t largest_bytes = 0;
+    for (int i = 0; i < job->my_num_partitions; i++) {
+      partition_data *partition = job->partition_data_list[i];
+      size_t bytes = __atomic_load_n(&partition->resident_bytes, __ATOMIC_RELAXED);
+      if (bytes > largest_bytes) {
+        largest = partition;
+        largest_bytes = bytes;
+      }
+    }
+    if (largest && spill_partition(largest, 0)) continue;
+
+    pthread_mutex_lock(&job->memory_lock);
+    int waited = 0;
+    while (job->spills_running > 0 &&
+           __atomic_load_n(&job->resident_bytes, __ATOMIC_RELAXED) > job->memory_budget) {
+      pthread_cond_wait(&job->memory_freed, &job->memory_lock);
+      waited = 1;
+    }
+    pthread_mutex_unlock(&job->memory_lock);
+    // Nothing is spilling and nothing could be spilled, the rest of the
+    // budget is held by records still staged in mapper buffers
+    if (!waited) return;
+  }
+}
+
+void run_reader_advance(run_reader *reader) {
+  if (reader->list) {
+    if (reader->pos >= reader->list->next_to_fill) {
+      reader->done = 1;
+      return;
+    }
+    reader->key = reader->list->keys[reader->pos];
+    reader->key_len = reader->list->key_lens[reader->pos];
+    reader->value = reader->list->values[reader->pos];
+    reader->value_len = value_len(reader->value);
+    reader->pos++;
+    return;
+  }
+
+  u_int32_t lens[2];
+  if (fread(lens, sizeof(lens), 1, reader->file) != 1) {
+    reader->done = 1;
+    return;
+  }
+  size_t needed = (size_t)lens[0] + sizeof(u_int32_t) + lens[1] + 2;
+  if (needed > reader->capacity) {
+    char *buffer = realloc(reader->buffer, needed);
+    if (!buffer) {
+      fprintf(stderr, "Memory allocation failed while merging spill runs\n");
+      exit(EXIT_FAILURE);
+    }
+    reader->buffer = buffer;
+    reader->capacity = needed;
+  }
+  reader->key = reader->buffer;
+  reader->value = reader->buffer + lens[0] + 1 + sizeof(u_int32_t);
+  memcpy(reader->value - sizeof(u_int32_t), &lens[1], sizeof(u_int32_t));
+  if (fread(reader->key, 1, lens[0], reader->file) != lens[0] ||
+      fread(reader->value, 1, lens[1], reader->file) != lens[1]) {
+    fprintf(stderr, "Read failed for spill file\n");
+    exit(EXIT_FAILURE);
+  }
+  reader->key[lens[0]] = '\0';
+  reader->value[lens[1]] = '\0';
+  reader->key_len = lens[0];
+  reader->value_len = lens[1];
+}
+
+int compare_keys(const char *key1, u_int32_t len1, const char *key2, u_int32_t len2) {
+  int cmp = memcmp(key1, key2, len1 < len2 ? len1 : len2);
+  if (cmp != 0) return cmp;
+  return (len1 > len2) - (len1 < len2);
+}
+
+// Exhausted readers lose every match
+int merge_less(merge_state *merge, int a, int b) {
+  run_reader *ra = &merge->readers[a];
+  run_reader *rb = &merge->readers[b];
+  if (ra->done) return 0;
+  if (rb->done) return 1;
+  int cmp = compare_keys(ra->key, ra->key_len, rb->key, rb->key_len);
+  return cmp < 0 || (cmp == 0 && a < b);
+}
+
+int loser_tree_build(merge_state *merge, int node) {
+  if (node >= merge->k) return node - merge->k;
+  int left = loser_tree_build(merge, 2 * node);
+  int right = loser_tree_build(merge, 2 * node + 1);
+  if (merge_less(merge, left, right)) {
+    merge->tree[node] = right;
+    return left;
+  }
+  merge->tree[node] = left;
+  return right;
+}
+
+// Advance the winner and replay its matches up to the root
+void loser_tree_next(merge_state *merge) {
+  int winner = merge->tree[0];
+  run_reader_advance(&merge->readers[winner]);
+  for (int node = (winner + merge->k) / 2; node >= 1; node /= 2) {
+    if (merge_less(merge, merge->tree[node], winner)) {
+      int loser = winner;
+      winner = merge->tree[node];
+      merge->tree[node] = loser;
+    }
+  }
+  merge->tree[0] = winner;
+}
+
+run_reader *merge_top(merge_state *merge) {
+  run_reader *top = &merge->readers[merge->tree[0]];
+  return top->done ? NULL : top;
+}
+
+// Merge the runs, then the sorted records of list unless it is NULL
+void merge_init_runs(merge_state *merge, spill_run *runs, int num_runs, record_list *list) {
+  memset(merge, 0, sizeof(merge_state));
+  merge->k = num_runs + (list != NULL);
+  merge->readers = calloc(merge->k, sizeof(run_reader));
+  merge->tree = calloc(merge->k, sizeof(int));
+  if (!merge->readers || !merge->tree) {
+    fprintf(stderr, "Memory allocation failed while merging spill runs\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < num_runs; i++) {
+    merge->readers[i].file = runs[i].file;
+    run_reader_advance(&merge->readers[i]);
+  }
+  if (list) {
+    merge->readers[merge->k - 1].list = list;
+    run_reader_advance(&merge->readers[merge->k - 1]);
+  }
+  merge->tree[0] = loser_tree_build(merge, 1);
+}
+
+// Merge everything a spilled partition holds, first folding its newest
+// runs together until no more than SPILL_MERGE_FAN_IN inputs are left
+void merge_init(merge_state *merge, partition_data *partition) {
+  int in_memory = partition->records.next_to_fill > 0;
+  while (partition->num_runs + in_memory > SPILL_MERGE_FAN_IN) {
+    int first = partition->num_runs - SPILL_MERGE_FAN_IN;
+    merge_spill_runs(partition, first > 0 ? first : 0);
+  }
+  if (in_memory) sort_records(&partition->records);
+  merge_init_runs(merge, partition->runs, partition->num_runs,
+                  in_memory ? &partition->records : NULL);
+}
+
+void merge_destroy(merge_state *merge) {
+  for (int i = 0; i < merge->k; i++) {
+    free(merge->readers[i].buffer);
+  }
+  free(merge->readers);
+  free(merge->tree);
+  free(merge->key);
+  arena_release(&merge->values);
+}
+
+// Make the key at the top of the merge the one being reduced
+char *merge_start_key(merge_state *merge) {
+  run_reader *top = merge_top(merge);
+  if (top->key_len + 1 > merge->key_capacity) {
+    char *key = realloc(merge->key, top->key_len + 1);
+    if (!key) {
+      fprintf(stderr, "Memory allocation failed while merging spill runs\n");
+      exit(EXIT_FAILURE);
+    }
+    merge->key = key;
+    merge->key_capacity = top->key_len + 1;
+  }
+  memcpy(merge->key, top->key, top->key_len + 1);
+  merge->key_len = top->key_len;
+  arena_reset(&merge->values);
+  return merge->key;
+}
+
+// Next value of the current key; it stays valid until the reducer returns
+char *merge_next_value(merge_state *merge) {
+  run_reader *top = merge_top(merge);
+  if (!top || compare_keys(top->key, top->key_len, merge->key, merge->key_len) != 0) {
+    return NULL;
+  }
+  char *data = arena_alloc(&merge->values, sizeof(u_int32_t) + top->value_len + 1);
+  char *value = store_value(data, top->value, top->value_len);
+  loser_tree_next(merge);
+  return value;
+}
+
+char *mapped_key(partition_data *partition, ulong k) {
+  return partition->mapped + partition->mapped_index[k].key_offset + sizeof(u_int32_t);
+}
+
+// Binary search over the sorted keys, for lookups off the current key;
+// keys compare by bytes and then length, the order they were sorted in
+MR_Cursor *find_cursor(partition_data *partition, char *key, size_t len) {
+  if (partition->mapped) {
+    ulong lo = 0, hi = partition->num_keys;
+    while (lo < hi) {
+      ulong mid = lo + (hi - lo) / 2;
+      char *other = mapped_key(partition, mid);
+      int cmp = compare_keys(key, len, other, value_len(other));
+      if (cmp == 0) return &partition->cursors[mid];
+      if (cmp < 0) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return NULL;
+  }
+  if (partition->group_table) {
+    record_list *list = &partition->records;
+    ulong hash = key_hash(key, len);
+    ulong mask = (1UL << partition->group_bits) - 1;
+    ulong slot = hash >> (64 - partition->group_bits);
+    while (partition->group_table[slot]) {
+      ulong k = partition->group_table[slot] - 1;
+      ulong r = partition->start_idxs[k];
+      if (list->key_hashes[r] == hash && list->key_lens[r] == len &&
+          memcmp(list->keys[r], key, len) == 0) {
+        return &partition->cursors[k];
+      }
+      slot = (slot + 1) & mask;
+    }
+    return NULL;
+  }
+  ulong lo = 0, hi = partition->num_keys;
+  while (lo < hi) {
+    ulong mid = lo + (hi - lo) / 2;
+    ulong r = partition->start_idxs[mid];
+    int cmp = compare_keys(key, len, partition->records.keys[r], partition->records.key_lens[r]);
+    if (cmp == 0) return &partition->cursors[mid];
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return NULL;
+}
+
+// Handle on the values of key; the key being reduced needs no lookup.
+// Spilled partitions only stream the key being reduced.
+MR_Cursor *MR_GetCursor(char *key, int num_partition) {
+  partition_data *partition = current_job->partition_data_list[num_partition];
+  size_t len = MR_KeyLength(key);
+  if (partition == reducing_partition &&
+      (key == reducing_key ||
+       compare_keys(key, len, reducing_key, reducing_key_len) == 0)) {
+    return reducing_cursor;
+  }
+  if (partition->num_runs > 0 && !partition->mapped) return NULL;
+  return find_cursor(partition, key, len);
+}
+
+// Values in a mapping follow each other, each behind its length
+char *mapped_next_value(MR_Cursor *cursor) {
+  char *value = cursor->mapped;
+  cursor->mapped += value_len(value) + 1 + sizeof(u_int32_t);
+  cursor->mapped_left--;
+  return value;
+}
+
+char *MR_CursorNext(MR_Cursor *cursor) {
+  if (!cursor) return NULL;
+  if (cursor->merge) return merge_next_value(cursor->merge);
+  if (cursor->mapped_left > 0) return mapped_next_value(cursor);
+  if (cursor->next >= cursor->end) return NULL;
+  return *cursor->next++;
+}
+
+int MR_CursorNextBatch(MR_Cursor *cursor, char **values, int max_values) {
+  int count = 0;
+  if (!cursor) return 0;
+  if (cursor->merge) {
+    char *value;
+    while (count < max_values && (value = merge_next_value(cursor->merge))) {
+      values[count++] = value;
+    }
+    return count;
+  }
+  while (count < max_values && cursor->mapped_left > 0) {
+    values[count++] = mapped_next_value(cursor);
+  }
+  while (count < max_values && cursor->next < cursor->end) {
+    values[count++] = *cursor->next++;
+  }
+  return count;
+}
+
+char *Get(char *key, int num_partition) {
+  return MR_CursorNext(MR_GetCursor(key, num_partition));
+}
+
+// Next value of key with its length, for values from MR_EmitBytes
+char *MR_GetBytes(char *key, int num_partition, size_t *len) {
+  char *value = Get(key, num_partition);
+  if (value && len) *len = value_len(value);
+  return value;
+}
+
+// Next value emitted with MR_EmitLong; returns 0 once key has no more
+int MR_GetLong(char *key, int num_partition, long *value) {
+  size_t len;
+  char *bytes = MR_GetBytes(key, num_partition, &len);
+  if (!bytes) return 0;
+  if (len != sizeof(long)) {
+    fprintf(stderr, "Value of %s was not emitted with MR_EmitLong\n", key);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(value, bytes, sizeof(long));
+  return 1;
+}
+
+// Length of the key being reduced, which may hold NUL bytes; other keys
+// are taken as C strings
+size_t MR_KeyLength(char *key) {
+  return key == reducing_key ? reducing_key_len : strlen(key);
+}
+
+// Batch getter, returns how many values were written to values
+int MR_GetBatch(char *key, int num_partition, char **values, int max_values) {
+  return MR_CursorNextBatch(MR_GetCursor(key, num_partition), values, max_values);
+}
+
+void MR_SetReduceMode(int mode) {
+  reduce_mode = mode;
+}
+
+// Group each partition's keys with a hash table instead of sorting them;
+// reducers then see a partition's keys in no particular order. Spilled
+// partitions are still merged in key order.
+void MR_SetHashGrouping(int enabled) {
+  hash_grouping = enabled;
+}
+
+// Store each distinct key of a partition once and have records point at
+// it; pays off when few keys are emitted many times
+void MR_SetKeyInterning(int enabled) {
+  intern_keys = enabled;
+}
+
+// In the parallel and ordered reduce modes, a partition holding more than
+// its share of the records is reduced by several reducers at once, each
+// taking a range of its keys (on by default). Turn it off for reducers
+// that read keys other than the one they are called for.
+void MR_SetPartitionSplitting(int enabled) {
+  split_partitions = enabled;
+}
+
+// Reducer output; buffered per partition in MR_REDUCE_ORDERED mode
+void MR_Printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  if (!reducing_output || current_job->reduce_mode != MR_REDUCE_ORDERED) {
+    vprintf(format, args);
+    va_end(args);
+    return;
+  }
+
+  output_buffer *out = reducing_output;
+  va_list args_copy;
+  va_copy(args_copy, args);
+  int needed = vsnprintf(out->data ? out->data + out->len : NULL,
+                         out->capacity - out->len, format, args_copy);
+  va_end(args_copy);
+  if (needed >= 0 && out->len + needed >= out->capacity) {
+    size_t capacity = out->capacity ? out->capacity * 2 : 4096;
+    while (capacity <= out->len + needed) capacity *= 2;
+    char *data = realloc(out->data, capacity);
+    if (!data) {
+      fprintf(stderr, "Memory allocation failed in MR_Printf\n");
+      exit(EXIT_FAILURE);
+    }
+    out->data = data;
+    out->capacity = capacity;
+    vsnprintf(out->data + out->len, out->capacity - out->len, format, args);
+  }
+  if (needed > 0) out->len += needed;
+  va_end(args);
+}
+
+// Keep a record of reduce output as map input for the next round of an
+// iterative job. Only valid in its reducers; the record stays in the
+// partition being reduced.
+void MR_EmitResultBytes(char *key, size_t key_len, void *value, size_t len) {
+  resident_table *table = reducing_results;
+  if (!table) {
+    fprintf(stderr, "MR_EmitResult called outside the reducer of an iterative job\n");
+    exit(EXIT_FAILURE);
+  }
+  if (table->records.size_of_list == 0) {
+    record_list_init(&table->records, INIT_MAX_RECORDS_PARTITION);
+  }
+  record_list_reserve(&table->records, 1);
+  record_list_push(&table->records, &table->arena, key, key_len, 0, (char *)value, len, NULL);
+}
+
+void MR_EmitResult(char *key, char *value) {
+  MR_EmitResultBytes(key, strlen(key), value, strlen(value));
+}
+
+// Calls fn on every record the round that just finished kept; meant for
+// the Converged callback, and for collecting the final result from it
+void MR_ForEachResult(RecordMapper fn) {
+  mr_iteration *iteration = current_iteration;
+  if (!iteration) return;
+  for (int p = 0; p < iteration->num_partitions; p++) {
+    record_list *records = &iteration->outputs[p].records;
+    for (ulong i = 0; i < records->next_to_fill; i++) {
+      fn(records->keys[i], records->key_lens[i], records->values[i],
+         value_len(records->values[i]), p);
+    }
+  }
+}
+
+void write_ordered_output() {
+  mr_job *job = current_job;
+  for (int i = 0; i < job->my_num_partitions; i++) {
+    partition_data *partition = job->partition_data_list[i];
+    output_buffer *out = &partition->output;
+    if (out->len > 0) fwrite(out->data, 1, out->len, stdout);
+    for (int j = 0; j < partition->num_slices; j++) {
+      out = &partition->slices[j].output;
+      if (out->len > 0) fwrite(out->data, 1, out->len, stdout);
+    }
+  }
+  fflush(stdout);
+}
+
+// Reduce a partition with spilled runs by streaming a k-way merge of the
+// runs and whatever is still in memory
+void reduce_spilled_partition(int partition_idx) {
+  mr_job *job = current_job;
+  partition_data *partition = job->partition_data_list[partition_idx];
+  merge_state merge;
+  MR_Cursor cursor = {NULL, NULL, &merge, NULL, 0};
+  merge_init(&merge, partition);
+
+  reducing_partition = partition;
+  reducing_cursor = &cursor;
+  while (merge_top(&merge)) {
+    partition->stats->keys++;
+    reducing_key = merge_start_key(&merge);
+    reducing_key_len = merge.key_len;
+    job->reduce_function(reducing_key, Get, partition_idx);
+    // Skip whatever the reducer left unread for this key
+    while (merge_next_value(&merge)) {
+    }
+    sem_post(&partition->sent_flag);
+  }
+  reducing_partition = NULL;
+  reducing_key = NULL;
+  reducing_cursor = NULL;
+  merge_destroy(&merge);
+}
+
+#define PERSIST_MAGIC "MRPART1"
+
+char *persisted_path(const char *directory, int partition_idx) {
+  size_t len = strlen(directory) + sizeof("/partition-.mrp") + 12;
+  char *path = malloc(len);
+  if (!path) {
+    fprintf(stderr, "Memory allocation failed for persisted file name\n");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(path, len, "%s/partition-%05d.mrp", directory, partition_idx);
+  return path;
+}
+
+void persist_write(persist_writer *writer, const void *data, size_t len) {
+  if (fwrite(data, 1, len, writer->file) != len) {
+    fprintf(stderr, "Write failed for persisted partition %s\n", writer->path);
+    exit(EXIT_FAILURE);
+  }
+  writer->offset += len;
+}
+
+void persist_open(persist_writer *writer, int partition_idx) {
+  memset(writer, 0, sizeof(persist_writer));
+  writer->path = persisted_path(current_job->persist_directory, partition_idx);
+  writer->file = fopen(writer->path, "wb");
+  if (!writer->file) {
+    fprintf(stderr, "Cannot create persisted partition %s\n", writer->path);
+    exit(EXIT_FAILURE);
+  }
+  setvbuf(writer->file, NULL, _IOFBF, SPILL_IO_BUFFER_SIZE);
+  // The header is rewritten once the index is known
+  persist_header header;
+  memset(&header, 0, sizeof(persist_header));
+  persist_write(writer, &header, sizeof(persist_header));
+}
+
+void persist_start_key(persist_writer *writer, char *key, u_int32_t key_len) {
+  if (writer->num_keys == writer->capacity) {
+    writer->capacity = writer->capacity ? writer->capacity * 2 : 1024;
+    writer->keys = realloc(writer->keys, sizeof(persist_key) * writer->capacity);
+    if (!writer->keys) {
+      fprintf(stderr, "Memory allocation failed for persisted index\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  persist_key *entry = &writer->keys[writer->num_keys++];
+  entry->entry.key_offset = writer->offset;
+  entry->entry.num_values = 0;
+  entry->key = key;
+  entry->key_len = key_len;
+  persist_write(writer, &key_len, sizeof(u_int32_t));
+  persist_write(writer, key, key_len);
+  persist_write(writer, "", 1);
+}
+
+// Values already sit behind their length, so they go out in one write
+void persist_value(persist_writer *writer, char *value) {
+  persist_write(writer, value - sizeof(u_int32_t), sizeof(u_int32_t) + value_len(value) + 1);
+  writer->keys[writer->num_keys - 1].entry.num_values++;
+  writer->num_values++;
+}
+
+int persist_key_comparator(const void *key1, const void *key2) {
+  const persist_key *k1 = (const persist_key *)key1;
+  const persist_key *k2 = (const persist_key *)key2;
+  return compare_keys(k1->key, k1->key_len, k2->key, k2->key_len);
+}
+
+// Append the index, sorted by key unless the keys came sorted, and fill
+// in the header
+void persist_close(persist_writer *writer, int sorted) {
+  if (!sorted) {
+    qsort(writer->keys, writer->num_keys, sizeof(persist_key), persist_key_comparator);
+  }
+  static const char padding[sizeof(u_int64_t)];
+  persist_write(writer, padding, -writer->offset & (sizeof(u_int64_t) - 1));
+  persist_header header;
+  memcpy(header.magic, PERSIST_MAGIC, sizeof(header.magic));
+  header.num_keys = writer->num_keys;
+  header.num_values = writer->num_values;
+  header.index_offset = writer->offset;
+  for (ulong k = 0; k < writer->num_keys; k++) {
+    persist_write(writer, &writer->keys[k].entry, sizeof(persist_entry));
+  }
+  if (fseek(writer->file, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(persist_header), 1, writer->file) != 1 ||
+      fclose(writer->file) != 0) {
+    fprintf(stderr, "Write failed for persisted partition %s\n", writer->path);
+    exit(EXIT_FAILURE);
+  }
+  free(writer->keys);
+  free(writer->path);
+}
+
+// Write a sorted (or hash grouped) partition in reduce order
+void persist_partition(int partition_idx) {
+  partition_data *partition = current_job->partition_data_list[partition_idx];
+  record_list *list = &partition->records;
+  persist_writer writer;
+  persist_open(&writer, partition_idx);
+  for (ulong k = 0; k < partition->num_keys; k++) {
+    ulong start = partition->start_idxs[k];
+    persist_start_key(&writer, list->keys[start], list->key_lens[start]);
+    for (ulong i = start; i < partition->end_idxs[k]; i++) {
+      persist_value(&writer, list->values[i]);
+    }
+  }
+  persist_close(&writer, partition->group_table == NULL);
+}
+
+// Whether an index entry names a whole key and all of its values, each a
+// u32 length, the bytes and a NUL, in the data section between the header
+// and the index; span is set to the bytes they take up
+int persisted_entry_valid(char *data, persist_header *header, persist_entry *entry,
+                          persist_span *span) {
+  u_int64_t offset = entry->key_offset;
+  u_int64_t end = header->index_offset;
+  if (offset < sizeof(persist_header) || offset > end) return 0;
+  span->start = offset;
+  for (u_int64_t i = 0; i <= entry->num_values; i++) {
+    if (end - offset < sizeof(u_int32_t) + 1) return 0;
+    char *field = data + offset + sizeof(u_int32_t);
+    u_int32_t len = value_len(field);
+    if (len > end - offset - sizeof(u_int32_t) - 1 || field[len] != '\0') return 0;
+    offset += sizeof(u_int32_t) + len + 1;
+  }
+  span->end = offset;
+  return 1;
+}
+
+int persist_span_comparator(const void *span1, const void *span2) {
+  const persist_span *s1 = (const persist_span *)span1;
+  const persist_span *s2 = (const persist_span *)span2;
+  return (s1->start > s2->start) - (s1->start < s2->start);
+}
+
+// Keys may not share bytes, so no key reads another's values as its own
+int persisted_spans_disjoint(persist_span *spans, ulong num_spans) {
+  qsort(spans, num_spans, sizeof(persist_span), persist_span_comparator);
+  for (ulong k = 1; k < num_spans; k++) {
+    if (spans[k - 1].end > spans[k].start) return 0;
+  }
+  return 1;
+}
+
+// Map a persisted partition and point one cursor per key into it; the
+// keys and values are never copied
+void map_persisted_partition(int partition_idx, const char *directory) {
+  partition_data *partition = current_job->partition_data_list[partition_idx];
+  char *path = persisted_path(directory, partition_idx);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Cannot open persisted partition %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  size_t size = st.st_size;
+  char *data = MAP_FAILED;
+  if (size >= sizeof(persist_header)) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Cannot map persisted partition %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  persist_header header;
+  memcpy(&header, data, sizeof(persist_header));
+  if (memcmp(header.magic, PERSIST_MAGIC, sizeof(header.magic)) != 0 ||
+      header.index_offset % sizeof(u_int64_t) != 0 || header.index_offset > size ||
+      header.num_keys > (size - header.index_offset) / sizeof(persist_entry)) {
+    fprintf(stderr, "Not a persisted partition: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  partition->mapped = data;
+  partition->mapped_size = size;
+  partition->mapped_index = (persist_entry *)(data + header.index_offset);
+  partition->num_keys = header.num_keys;
+  partition->cursors = (MR_Cursor *)malloc(sizeof(MR_Cursor) * (header.num_keys + 1));
+  if (!partition->cursors) {
+    fprintf(stderr, "Memory allocation failed for persisted partition\n");
+    exit(EXIT_FAILURE);
+  }
+  persist_span *spans = (persist_span *)malloc(sizeof(persist_span) * (header.num_keys + 1));
+  if (!spans) {
+    fprintf(stderr, "Memory allocation failed for persisted partition\n");
+    exit(EXIT_FAILURE);
+  }
+  u_int64_t num_values = 0;
+  u_int64_t payload = 0;  // key and value bytes, without lengths and NULs
+  for (ulong k = 0; k < header.num_keys; k++) {
+    if (!persisted_entry_valid(data, &header, &partition->mapped_index[k], &spans[k])) {
+      fprintf(stderr, "Not a persisted partition: %s\n", path);
+      exit(EXIT_FAILURE);
+    }
+    num_values += partition->mapped_index[k].num_values;
+    payload += spans[k].end - spans[k].start -
+               (partition->mapped_index[k].num_values + 1) * (sizeof(u_int32_t) + 1);
+    char *key = mapped_key(partition, k);
+    MR_Cursor *cursor = &partition->cursors[k];
+    memset(cursor, 0, sizeof(MR_Cursor));
+    cursor->mapped = key + value_len(key) + 1 + sizeof(u_int32_t);
+    cursor->mapped_left = partition->mapped_index[k].num_values;
+  }
+  if (num_values != header.num_values || !persisted_spans_disjoint(spans, header.num_keys)) {
+    fprintf(stderr, "Not a persisted partition: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  free(spans);
+  free(path);
+  partition->stats->keys = header.num_keys;
+  if (current_job->load_directory) {
+    partition->stats->records = header.num_values;
+    partition->stats->bytes = payload;
+  }
+}
+
+// A spilled partition is persisted straight from the merge of its runs,
+// then reduced from the file like a reduce-only job would
+void persist_spilled_partition(int partition_idx) {
+  partition_data *partition = current_job->partition_data_list[partition_idx];
+  merge_state merge;
+  persist_writer writer;
+  merge_init(&merge, partition);
+  persist_open(&writer, partition_idx);
+  while (merge_top(&merge)) {
+    char *key = merge_start_key(&merge);
+    persist_start_key(&writer, key, merge.key_len);
+    char *value;
+    while ((value = merge_next_value(&merge))) {
+      persist_value(&writer, value);
+    }
+  }
+  persist_close(&writer, 1);
+  merge_destroy(&merge);
+  map_persisted_partition(partition_idx, current_job->persist_directory);
+}
+
+void reduce_mapped_partition(int partition_idx) {
+  mr_job *job = current_job;
+  partition_data *partition = job->partition_data_list[partition_idx];
+  reducing_partition = partition;
+  for (ulong k = 0; k < partition->num_keys; k++) {
+    char *key = mapped_key(partition, k);
+    reducing_key = key;
+    reducing_key_len = value_len(key);
+    reducing_cursor = &partition->cursors[k];
+    job->reduce_function(key, Get, partition_idx);
+    sem_post(&partition->sent_flag);
+  }
+  reducing_partition = NULL;
+  reducing_key = NULL;
+  reducing_cursor = NULL;
+  if (partition->num_keys == 0) {
+    sem_post(&partition->sent_flag);
+  }
+}
+
+// Reduce keys [first_key, end_key) of a sorted partition
+void reduce_key_range(int partition_idx, ulong first_key, ulong end_key) {
+  mr_job *job = current_job;
+  partition_data *partition = job->partition_data_list[partition_idx];
+  reducing_partition = partition;
+  for (ulong i = first_key; i < end_key; i++) {
+    char *key = partition->records.keys[partition->start_idxs[i]];
+    reducing_key = key;
+    reducing_key_len = partition->records.key_lens[partition->start_idxs[i]];
+    reducing_cursor = &partition->cursors[i];
+    job->reduce_function(key, Get, partition_idx);
+    sem_post(&partition->sent_flag);
+  }
+  reducing_partition = NULL;
+  reducing_key = NULL;
+  reducing_cursor = NULL;
+}
+
+// Cut a sorted partition holding more than a reducer's even share of the
+// records into key ranges of about equal record counts, one per reducer,
+// and offer them to the other reducers. Returns 0 when it stays whole.
+int split_partition(int partition_idx) {
+  mr_job *job = current_job;
+  partition_data *partition = job->partition_data_list[partition_idx];
+  ulong records = partition->records.next_to_fill;
+  ulong num_slices = records / SPLIT_MIN_RECORDS;
+  if (num_slices > (ulong)job->num_reducers) num_slices = job->num_reducers;
+  if (!job->split_partitions || records <= job->split_records || num_slices < 2 ||
+      partition->num_keys < 2) {
+    return 0;
+  }
+  reduce_slice *slices = (reduce_slice *)calloc(num_slices, sizeof(reduce_slice));
+  if (!slices) {
+    fprintf(stderr, "Memory allocation failed for reduce slices\n");
+    exit(EXIT_FAILURE);
+  }
+  // Each cut goes to the first key starting at or after its share; a hot
+  // key never gets cut, so some ranges may come out empty and are dropped
+  int count = 0;
+  ulong first_key = 0;
+  for (ulong s = 1; s <= num_slices; s++) {
+    ulong end_key = partition->num_keys;
+    if (s < num_slices) {
+      ulong target = records / num_slices * s;
+      ulong lo = first_key, hi = partition->num_keys;
+      while (lo < hi) {
+        ulong mid = lo + (hi - lo) / 2;
+        if (partition->start_idxs[mid] < target) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      end_key = lo;
+    }
+    if (end_key == first_key) continue;
+    slices[count].partition_idx = partition_idx;
+    slices[count].first_key = first_key;
+    slices[count].end_key = end_key;
+    count++;
+    first_key = end_key;
+  }
+  if (count < 2) {
+    free(slices);
+    return 0;
+  }
+  partition->slices = slices;
+  partition->num_slices = count;
+  partition->next_slice = 0;
+  partition->slices_left = count;
+  partition->stats->reduce_ns = 0;
+  pthread_mutex_lock(&job->slice_lock);
+  partition->next_split = job->split_head;
+  job->split_head = partition;
+  pthread_cond_broadcast(&job->slices_posted);
+  pthread_mutex_unlock(&job->slice_lock);
+  return 1;
+}
+
+// A partition's reducer is done deciding whether to split it
+void partition_sorted() {
+  mr_job *job = current_job;
+  pthread_mutex_lock(&job->slice_lock);
+  if (--job->partitions_unsorted == 0) pthread_cond_broadcast(&job->slices_posted);
+  pthread_mutex_unlock(&job->slice_lock);
+}
+
+// The results of a split partition's slices go to the partition's table
+// in slice order, once all of them are reduced
+void gather_slice_results(int partition_idx) {
+  mr_job *job = current_job;
+  partition_data *partition = job->partition_data_list[partition_idx];
+  resident_table *table = &job->resident_outputs[partition_idx];
+  for (int j = 0; j < partition->num_slices; j++) {
+    record_list *from = &partition->slices[j].results.records;
+    ulong n = from->next_to_fill;
+    if (n == 0) continue;
+    if (table->records.size_of_list == 0) {
+      record_list_init(&table->records, INIT_MAX_RECORDS_PARTITION);
+    }
+    record_list_reserve(&table->records, n);
+    record_list *list = &table->records;
+    ulong at = list->next_to_fill;
+    memcpy(list->keys + at, from->keys, sizeof(char *) * n);
+    memcpy(list->values + at, from->values, sizeof(char *) * n);
+    memcpy(list->key_prefixes + at, from->key_prefixes, sizeof(ulong) * n);
+    memcpy(list->key_lens + at, from->key_lens, sizeof(u_int32_t) * n);
+    memcpy(list->key_hashes + at, from->key_hashes, sizeof(ulong) * n);
+    list->next_to_fill += n;
+    arena_splice(&table->arena, &partition->slices[j].results.arena);
+  }
+}
+
+// Claim and reduce slices of split partitions until none are left to
+// claim. With wait set, also wait for partitions still being sorted,
+// which may yet be split; returns the time spent waiting.
+ulong reduce_slices(int wait) {
+  mr_job *job = current_job;
+  ulong waited = 0;
+  pthread_mutex_lock(&job->slice_lock);
+  while (1) {
+    partition_data *partition = job->split_head;
+    if (!partition) {
+      if (!wait || job->partitions_unsorted == 0) break;
+      ulong wait_start = now_ns();
+      pthread_cond_wait(&job->slices_posted, &job->slice_lock);
+      waited += now_ns() - wait_start;
+      continue;
+    }
+    reduce_slice *slice = &partition->slices[partition->next_slice++];
+    if (partition->next_slice == partition->num_slices) {
+      job->split_head = partition->next_split;
+    }
+    pthread_mutex_unlock(&job->slice_lock);
+
+    ulong reduce_start = now_ns();
+    reducing_output = &slice->output;
+    reducing_results = job->resident_outputs ? &slice->results : NULL;
+    reduce_key_range(slice->partition_idx, slice->first_key, slice->end_key);
+    reducing_output = NULL;
+    reducing_results = NULL;
+    __atomic_add_fetch(&partition->stats->reduce_ns, now_ns() - reduce_start, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&partition->slices_left, 1, __ATOMIC_ACQ_REL) == 0 &&
+        job->resident_outputs) {
+      gather_slice_results(slice->partition_idx);
+    }
+    pthread_mutex_lock(&job->slice_lock);
+  }
+  pthread_mutex_unlock(&job->slice_lock);
+  return waited;
+}
+
+void reduce_controller(int reducer_idx) {
+  mr_job *job = current_job;
+  int partition_to_reduce = -1;
+  ulong start = now_ns(), waited = 0;
+
+  while ((partition_to_reduce = next_reduce_partition()) >= 0) {
+    partition_data *partition = job->partition_data_list[partition_to_reduce];
+    ulong sort_start = thread_cpu_ns();
+    gather_segments(partition, &partition->records);
+    if (job->load_directory) {
+      map_persisted_partition(partition_to_reduce, job->load_directory);
+    } else if (partition->num_runs == 0) {
+      sort_partition(partition_to_reduce);
+      partition->stats->keys = partition->num_keys;
+      if (job->persist_directory) persist_partition(partition_to_reduce);
+    } else if (job->persist_directory) {
+      persist_spilled_partition(partition_to_reduce);
+    }
+    int split = !partition->mapped && partition->num_runs == 0 &&
+                split_partition(partition_to_reduce);
+    partition_sorted();
+    partition->stats->sort_ns = thread_cpu_ns() - sort_start;
+    if (split) {
+      // Help with the slices, starting with this partition's own
+      waited += reduce_slices(0);
+      continue;
+    }
+    if (job->reduce_mode == MR_REDUCE_SERIAL && partition_to_reduce > 0) {
+      ulong wait_start = now_ns();
+      sem_wait(&job->partition_data_list[partition_to_reduce - 1]->sent_flag);
+      waited += now_ns() - wait_start;
+    }
+    reducing_results = job->resident_outputs ? &job->resident_outputs[partition_to_reduce] : NULL;
+    reducing_output = &partition->output;
+    ulong reduce_start = now_ns();
+    if (partition->mapped) {
+      reduce_mapped_partition(partition_to_reduce);
+      partition->stats->reduce_ns = now_ns() - reduce_start;
+      reducing_output = NULL;
+      continue;
+    }
+    if (partition->num_runs > 0) {
+      reduce_spilled_partition(partition_to_reduce);
+      partition->stats->reduce_ns = now_ns() - reduce_start;
+      reducing_output = NULL;
+      continue;
+    }
+
+    reduce_key_range(partition_to_reduce, 0, partition->num_keys);
+    if (partition->num_keys == 0) {
+      sem_post(&partition->sent_flag);
+    }
+    partition->stats->reduce_ns = now_ns() - reduce_start;
+    reducing_output = NULL;
+  }
+  reducing_results = NULL;
+  // Out of partitions: take slices of the ones being split
+  if (job->split_partitions) waited += reduce_slices(1);
+  // Waiting on the previous partition in serial mode, or for slices,
+  // counts as idle
+  job->reducer_busy_ns[reducer_idx] = now_ns() - start - waited;
+}
+
+// Free what a job left in a partition, keeping the locks, the first
+// record segment and the output buffer for the next job of a series
+void clear_partition(partition_data *partition) {
+    record_list_destroy(&partition->records);
+    arena_release(&partition->arena);
+    arena_release(&partition->shared_arena);
+    free(partition->start_idxs);
+    free(partition->end_idxs);
+    free(partition->cursors);
+    free(partition->group_table);
+    partition->start_idxs = NULL;
+    partition->end_idxs = NULL;
+    partition->cursors = NULL;
+    partition->group_table = NULL;
+    partition->group_bits = 0;
+    partition->num_keys = 0;
+    partition->resident_bytes = 0;
+    if (partition->mapped) munmap(partition->mapped, partition->mapped_size);
+    partition->mapped = NULL;
+    partition->mapped_size = 0;
+    partition->mapped_index = NULL;
+    for (int j = 0; j < partition->num_slices; j++) {
+      free(partition->slices[j].output.data);
+      record_list_destroy(&partition->slices[j].results.records);
+      arena_release(&partition->slices[j].results.arena);
+    }
+    free(partition->slices);
+    partition->slices = NULL;
+    partition->num_slices = 0;
+    intern_table_destroy(&partition->interned);
+    for (int j = 0; j < partition->num_runs; j++) {
+      close_spill_run(&partition->runs[j]);
+    }
+    free(partition->runs);
+    partition->runs = NULL;
+    partition->num_runs = 0;
+    partition->output.len = 0;
+    sem_destroy(&partition->sent_flag);
+    sem_init(&partition->sent_flag, 0, 0);
+}
+
+void clear_partition_data_list() {
+  mr_job *job = current_job;
+  for (int i = 0; i < job->my_num_partitions; i++) {
+    clear_partition(job->partition_data_list[i]);
+  }
+}
+
+void destroy_partitions(partition_data **partitions, int num_partitions) {
+  if (!partitions) return;
+  for (int i = 0; i < num_partitions; i++) {
+    partition_data *partition = partitions[i];
+    if (!partition) continue;
+    clear_partition(partition);
+    free_record_segments(partition->segments);
+    free(partition->output.data);
+
+    pthread_mutex_destroy(&partition->lock);
+    pthread_rwlock_destroy(&partition->ingest_lock);
+    pthread_mutex_destroy(&partition->spill_lock);
+    sem_destroy(&partition->sent_flag);
+    free(partition);
+  }
+  free(partitions);
+}
+
+void destruct_partition_data_list() {
+  mr_job *job = current_job;
+  destroy_partitions(job->partition_data_list, job->my_num_partitions);
+  job->partition_data_list = NULL;
+}
+
+
+void MR_SetSampleSize(size_t bytes) {
+  sample_size = bytes > 0 ? bytes : DEFAULT_SAMPLE_SIZE;
+}
+
+// Reservoir sample of the keys emitted during the sampling pass
+void sample_key(char *key, size_t key_len) {
+  mr_job *job = current_job;
+  ulong slot = job->num_keys_seen++;
+  if (slot >= SAMPLE_MAX_KEYS) {
+    slot = ((ulong)rand_r(&job->sample_seed) * RAND_MAX + rand_r(&job->sample_seed)) % job->num_keys_seen;
+    if (slot >= SAMPLE_MAX_KEYS) return;
+  } else {
+    job->num_sampled_keys++;
+  }
+  job->sampled_keys[slot] = arena_alloc(&job->sample_arena, key_len + 1);
+  memcpy(job->sampled_keys[slot], key, key_len);
+  job->sampled_keys[slot][key_len] = '\0';
+}
+
+int sampled_key_comparator(const void *key1, const void *key2) {
+  return strcmp(*(char **)key1, *(char **)key2);
+}
+
+// Run the mapper over evenly spaced, line-aligned windows of every input.
+// File mappers get the windows through a temp file.
+void sample_inputs() {
+  mr_job *job = current_job;
+  size_t window_size = sample_size / (job->input_count > 0 ? job->input_count : 1) / SAMPLE_WINDOWS_PER_INPUT;
+  if (window_size < 4096) window_size = 4096;
+
+  for (int i = 0; i < job->input_count; i++) {
+    int fd = open(job->input_args[i], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr, "Cannot open input %s\n", job->input_args[i]);
+      exit(EXIT_FAILURE);
+    }
+    if (st.st_size == 0) {
+      close(fd);
+      continue;
+    }
+    size_t size = st.st_size;
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Cannot map input %s\n", job->input_args[i]);
+      exit(EXIT_FAILURE);
+    }
+
+    char *path = NULL;
+    FILE *sample_file = NULL;
+    if (!job->chunk_map_function) {
+      sample_file = fdopen(create_temp_file("mr-sample", &path), "w");
+      if (!sample_file) {
+        fprintf(stderr, "Cannot open sample file\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    size_t stride = size / SAMPLE_WINDOWS_PER_INPUT;
+    if (stride < window_size) stride = window_size;
+    for (size_t offset = 0; offset < size; offset += stride) {
+      size_t start = offset, end = offset + window_size;
+      if (start > 0) {
+        char *newline = memchr(data + start, '\n', size - start);
+        if (!newline) break;
+        start = newline - data + 1;
+      }
+      if (end >= size) {
+        end = size;
+      } else {
+        char *newline = memchr(data + end, '\n', size - end);
+        end = newline ? (size_t)(newline - data) + 1 : size;
+      }
+      if (start >= end) continue;
+      if (job->chunk_map_function) {
+        job->chunk_map_function(data + start, end - start, job->input_args[i]);
+      } else {
+        fwrite(data + start, 1, end - start, sample_file);
+      }
+    }
+    munmap(data, size);
+
+    if (sample_file) {
+      fclose(sample_file);
+      job->map_function(path);
+      unlink(path);
+      free(path);
+    }
+  }
+}
+
+// Sample the inputs and pick num_partitions - 1 evenly spaced splitters
+void compute_range_splitters() {
+  mr_job *job = current_job;
+  job->sampled_keys = (char **)malloc(sizeof(char *) * SAMPLE_MAX_KEYS);
+  if (!job->sampled_keys) {
+    fprintf(stderr, "Memory allocation failed for key sample\n");
+    exit(EXIT_FAILURE);
+  }
+  job->num_sampled_keys = 0;
+  job->num_keys_seen = 0;
+  job->sample_arena.head = NULL;
+  sample_inputs();
+
+  char **keys = job->sampled_keys;
+  job->sampled_keys = NULL;
+  qsort(keys, job->num_sampled_keys, sizeof(char *), sampled_key_comparator);
+
+  job->num_range_splitters = 0;
+  if (job->num_sampled_keys > 0 && job->my_num_partitions > 1) {
+    job->range_splitters = (char **)malloc(sizeof(char *) * (job->my_num_partitions - 1));
+    if (!job->range_splitters) {
+      fprintf(stderr, "Memory allocation failed for range splitters\n");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < job->my_num_partitions; i++) {
+      job->range_splitters[i - 1] = strdup(keys[(job->num_sampled_keys * i) / job->my_num_partitions]);
+    }
+    job->num_range_splitters = job->my_num_partitions - 1;
+  }
+  free(keys);
+  arena_release(&job->sample_arena);
+}
+
+void destruct_range_splitters() {
+  mr_job *job = current_job;
+  for (int i = 0; i < job->num_range_splitters; i++) {
+    free(job->range_splitters[i]);
+  }
+  free(job->range_splitters);
+  job->range_splitters = NULL;
+  job->num_range_splitters = 0;
+}
+
+void *pool_worker(void *arg) {
+  MR_Context *ctx = (MR_Context *)arg;
+  pthread_mutex_lock(&ctx->lock);
+  worker_idx = ctx->num_started++;
+  while (1) {
+    while (!ctx->head && !ctx->shutting_down) {
+      pthread_cond_wait(&ctx->work, &ctx->lock);
+    }
+    if (!ctx->head) break;
+    pool_task *task = ctx->head;
+    ctx->head = task->next;
+    if (!ctx->head) ctx->tail = NULL;
+    pthread_mutex_unlock(&ctx->lock);
+
+    mr_job *job = task->job;
+    current_job = job;
+    if (job->affinity != worker_affinity) pin_worker(job->affinity);
+    task->run(task->idx);
+    current_job = NULL;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (--job->pending_tasks == 0) {
+      pthread_cond_broadcast(&job->tasks_done);
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return NULL;
+}
+
+// Start workers until the pool has num_threads; the caller holds ctx->lock
+void context_grow(MR_Context *ctx, int num_threads) {
+  if (num_threads <= ctx->num_threads) return;
+  pthread_t *threads = (pthread_t *)realloc(ctx->threads, sizeof(pthread_t) * num_threads);
+  if (!threads) {
+    fprintf(stderr, "Memory allocation failed for context threads\n");
+    exit(EXIT_FAILURE);
+  }
+  ctx->threads = threads;
+  while (ctx->num_threads < num_threads) {
+    if (pthread_create(&ctx->threads[ctx->num_threads], NULL, pool_worker, ctx) != 0) {
+      fprintf(stderr, "Cannot start context worker thread\n");
+      exit(EXIT_FAILURE);
+    }
+    ctx->num_threads++;
+  }
+}
+
+// A pool of num_threads workers that stays up across jobs. Jobs started
+// from several threads share it, each job's mappers and reducers then
+// run at most num_threads at a time.
+MR_Context *MR_CreateContext(int num_threads) {
+  MR_Context *ctx = (MR_Context *)calloc(1, sizeof(MR_Context));
+  if (!ctx) {
+    fprintf(stderr, "Memory allocation failed for MR_Context\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_cond_init(&ctx->work, NULL);
+  pthread_mutex_lock(&ctx->lock);
+  context_grow(ctx, num_threads > 0 ? num_threads : 1);
+  pthread_mutex_unlock(&ctx->lock);
+  return ctx;
+}
+
+// Waits for queued work; no job may be running in ctx afterwards
+void MR_DestroyContext(MR_Context *ctx) {
+  pthread_mutex_lock(&ctx->lock);
+  ctx->shutting_down = 1;
+  pthread_cond_broadcast(&ctx->work);
+  pthread_mutex_unlock(&ctx->lock);
+  for (int i = 0; i < ctx->num_threads; i++) {
+    pthread_join(ctx->threads[i], NULL);
+  }
+  pthread_cond_destroy(&ctx->work);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx->threads);
+  free(ctx);
+}
+
+// Queue run(0) .. run(count - 1) for the current job and wait for them
+void run_phase(MR_Context *ctx, void (*run)(int), int count) {
+  mr_job *job = current_job;
+  if (count <= 0) return;
+  pool_task *tasks = (pool_task *)malloc(sizeof(pool_task) * count);
+  if (!tasks) {
+    fprintf(stderr, "Memory allocation failed for context tasks\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < count; i++) {
+    tasks[i].run = run;
+    tasks[i].job = job;
+    tasks[i].idx = i;
+    tasks[i].next = i + 1 < count ? &tasks[i + 1] : NULL;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  if (ctx->tail) {
+    ctx->tail->next = tasks;
+  } else {
+    ctx->head = tasks;
+  }
+  ctx->tail = &tasks[count - 1];
+  job->pending_tasks += count;
+  pthread_cond_broadcast(&ctx->work);
+  while (job->pending_tasks > 0) {
+    pthread_cond_wait(&job->tasks_done, &ctx->lock);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  free(tasks);
+}
+
+// The pool behind MR_Run; it grows to the largest job it has seen
+MR_Context *get_default_context(int num_threads) {
+  pthread_mutex_lock(&default_context_lock);
+  if (!default_context) {
+    default_context = MR_CreateContext(num_threads);
+  } else {
+    pthread_mutex_lock(&default_context->lock);
+    context_grow(default_context, num_threads);
+    pthread_mutex_unlock(&default_context->lock);
+  }
+  pthread_mutex_unlock(&default_context_lock);
+  return default_context;
+}
+
+// Charge the time since start to a phase and return the current time
+ulong end_phase(int phase, ulong start) {
+  ulong now = now_ns();
+  current_job->phase_ns[phase] += now - start;
+  return now;
+}
+
+void write_worker_times(FILE *report, const char *name, ulong *busy_ns, int count,
+                        ulong phase_ns) {
+  fprintf(report, "  \"%s\": [", name);
+  for (int i = 0; i < count; i++) {
+    ulong idle_ns = phase_ns > busy_ns[i] ? phase_ns - busy_ns[i] : 0;
+    fprintf(report, "%s\n    {\"busy_ms\": %.3f, \"idle_ms\": %.3f}", i ? "," : "",
+            busy_ns[i] / 1e6, idle_ns / 1e6);
+  }
+  fprintf(report, "\n  ],\n");
+}
+
+void write_job_report() {
+  mr_job *job = current_job;
+  FILE *report = fopen(job->report_path, "w");
+  if (!report) {
+    fprintf(stderr, "Cannot open job report %s\n", job->report_path);
+    return;
+  }
+  partition_stats total;
+  memset(&total, 0, sizeof(partition_stats));
+  for (int i = 0; i < job->my_num_partitions; i++) {
+    partition_stats *stats = &job->partition_stats[i];
+    total.records += stats->records;
+    total.bytes += stats->bytes;
+    total.resident_bytes += stats->resident_bytes;
+    total.keys += stats->keys;
+    total.lock_wait_ns += stats->lock_wait_ns;
+    total.sort_ns += stats->sort_ns;
+  }
+
+  static const char *phase_names[NUM_PHASES] = {"setup", "map", "reduce", "teardown"};
+  fprintf(report, "{\n  \"phases_ms\": {");
+  for (int i = 0; i < NUM_PHASES; i++) {
+    fprintf(report, "%s\"%s\": %.3f", i ? ", " : "", phase_names[i], job->phase_ns[i] / 1e6);
+  }
+  fprintf(report, "},\n");
+  fprintf(report, "  \"records\": %lu,\n  \"bytes\": %lu,\n  \"resident_bytes\": %lu,\n",
+          (unsigned long)total.records, (unsigned long)total.bytes,
+          (unsigned long)total.resident_bytes);
+  fprintf(report, "  \"keys\": %lu,\n", (unsigned long)total.keys);
+  fprintf(report, "  \"lock_wait_ms\": %.3f,\n", total.lock_wait_ns / 1e6);
+  fprintf(report, "  \"sort_cpu_ms\": %.3f,\n", total.sort_ns / 1e6);
+  fprintf(report, "  \"peak_resident_bytes\": %lu,\n", (unsigned long)job->peak_resident_bytes);
+  write_worker_times(report, "mappers", job->mapper_busy_ns, job->num_mappers,
+                     job->phase_ns[PHASE_MAP]);
+  write_worker_times(report, "reducers", job->reducer_busy_ns, job->num_reducers,
+                     job->phase_ns[PHASE_REDUCE]);
+  fprintf(report, "  \"partitions\": [");
+  for (int i = 0; i < job->my_num_partitions; i++) {
+    partition_stats *stats = &job->partition_stats[i];
+    fprintf(report,
+            "%s\n    {\"records\": %lu, \"bytes\": %lu, \"resident_bytes\": %lu, "
+            "\"keys\": %lu, \"lock_wait_ms\": %.3f, \"sort_ms\": %.3f, \"reduce_ms\": %.3f}",
+            i ? "," : "", (unsigned long)stats->records, (unsigned long)stats->bytes,
+            (unsigned long)stats->resident_bytes, (unsigned long)stats->keys,
+            stats->lock_wait_ns / 1e6, stats->sort_ns / 1e6, stats->reduce_ns / 1e6);
+  }
+  fprintf(report, "\n  ]\n}\n");
+  fclose(report);
+}
+
+void run_job(MR_Context *ctx, int argc, char *argv[], Mapper map, ChunkMapper chunk_map,
+             int num_mappers, Reducer reduce, int num_reducers,
+             Partitioner partition, int num_partitions, Combiner combine,
+             mr_iteration *iteration, const char *load_directory) {
+  mr_job job;
+  memset(&job, 0, sizeof(mr_job));
+  job.partition_function = partition;
+  job.my_num_partitions = num_partitions;
+  job.map_function = map;
+  job.chunk_map_function = chunk_map;
+  job.combine_function = combine;
+  job.reduce_function = reduce;
+  job.reduce_mode = reduce_mode;
+  job.hash_grouping = hash_grouping;
+  job.intern_keys = intern_keys;
+  job.load_directory = load_directory;
+  // A reduce-only job must not overwrite the files it reads
+  job.persist_directory = load_directory ? NULL : persist_directory;
+  job.affinity = affinity_policy;
+  job.spill_budget = spill_budget;
+  job.memory_budget = memory_budget;
+  job.input_count = argc - 1;
+  job.input_args = argv + sizeof(char);
+  job.map_task_count = job.input_count;
+  job.sample_seed = 1;
+  if (iteration) {
+    job.resident_outputs = iteration->outputs;
+    if (iteration->round > 0 && iteration->inputs) {
+      job.record_map_function = iteration->record_map_function;
+      job.resident_inputs = iteration->inputs;
+      job.map_task_count = num_partitions;
+    }
+  }
+  job.num_mappers = num_mappers;
+  job.num_reducers = num_reducers;
+  job.report_path = report_path;
+  job.mapper_busy_ns = (ulong *)calloc(num_mappers + 1, sizeof(ulong));
+  job.reducer_busy_ns = (ulong *)calloc(num_reducers + 1, sizeof(ulong));
+  job.partition_stats = (partition_stats *)calloc(num_partitions + 1, sizeof(partition_stats));
+  if (!job.mapper_busy_ns || !job.reducer_busy_ns || !job.partition_stats) {
+    fprintf(stderr, "Memory allocation failed for job statistics\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_cond_init(&job.tasks_done, NULL);
+  pthread_mutex_init(&job.memory_lock, NULL);
+  pthread_cond_init(&job.memory_freed, NULL);
+  mr_job *outer_job = current_job;
+  current_job = &job;
+
+  ulong phase_start = now_ns();
+  if (job.chunk_map_function) {
+    split_inputs();
+  }
+  if (job.partition_function == MR_SampledRangePartition) {
+    if (iteration && iteration->round > 0) {
+      job.range_splitters = iteration->range_splitters;
+      job.num_range_splitters = iteration->num_range_splitters;
+    } else {
+      compute_range_splitters();
+    }
+  }
+  if (iteration && iteration->partition_data_list) {
+    job.partition_data_list = iteration->partition_data_list;
+    attach_partition_data_list();
+  } else {
+    init_partition_data_list();
+  }
+  phase_start = end_phase(PHASE_SETUP, phase_start);
+  if (!job.load_directory) {
+    init_mapper_concurrency(num_mappers);
+    run_phase(ctx, map_control, num_mappers);
+    destruct_mapper_concurrency();
+  }
+  phase_start = end_phase(PHASE_MAP, phase_start);
+
+  init_reducer_concurrency();
+  run_phase(ctx, reduce_controller, num_reducers);
+  if (job.reduce_mode == MR_REDUCE_ORDERED) {
+    write_ordered_output();
+  }
+  phase_start = end_phase(PHASE_REDUCE, phase_start);
+  if (iteration) {
+    clear_partition_data_list();
+    iteration->partition_data_list = job.partition_data_list;
+  } else {
+    destruct_partition_data_list();
+  }
+  destruct_inputs();
+  if (iteration) {
+    iteration->range_splitters = job.range_splitters;
+    iteration->num_range_splitters = job.num_range_splitters;
+  } else {
+    destruct_range_splitters();
+  }
+  destruct_reducer_concurrency();
+  pthread_cond_destroy(&job.tasks_done);
+  pthread_mutex_destroy(&job.memory_lock);
+  pthread_cond_destroy(&job.memory_freed);
+  end_phase(PHASE_TEARDOWN, phase_start);
+
+  if (job.report_path) {
+    write_job_report();
+  }
+  free(job.mapper_busy_ns);
+  free(job.reducer_busy_ns);
+  free(job.partition_stats);
+
+  current_job = outer_job;
+}
+
+// Runs a job on the workers of ctx; MR_Run and friends use a shared
+// context that is created on first use. Must not be called from inside
+// a mapper or reducer of the same context.
+void MR_RunInContext(MR_Context *ctx, int argc, char *argv[], Mapper map,
+                     int num_mappers, Reducer reduce, int num_reducers,
+                     Partitioner partition, int num_partitions, Combiner combine) {
+  run_job(ctx, argc, argv, map, NULL, num_mappers, reduce, num_reducers, partition,
+          num_partitions, combine, NULL, NULL);
+}
+
+void MR_RunChunkedInContext(MR_Context *ctx, int argc, char *argv[], ChunkMapper map,
+                            int num_mappers, Reducer reduce, int num_reducers,
+                            Partitioner partition, int num_partitions) {
+  run_job(ctx, argc, argv, NULL, map, num_mappers, reduce, num_reducers, partition,
+          num_partitions, NULL, NULL, NULL);
+}
+
+void MR_RunWithCombiner(int argc, char *argv[], Mapper map, int num_mappers,
+                        Reducer reduce, int num_reducers, Partitioner partition,
+                        int num_partitions, Combiner combine) {
+  MR_Context *ctx = get_default_context(num_mappers > num_reducers ? num_mappers : num_reducers);
+  MR_RunInContext(ctx, argc, argv, map, num_mappers, reduce, num_reducers, partition,
+                  num_partitions, combine);
+}
+
+// Like MR_Run, but mappers get newline-aligned chunks of the inputs (see
+// MR_SetInputSplitSize) so one large file no longer pins one mapper
+void MR_RunChunked(int argc, char *argv[], ChunkMapper map, int num_mappers,
+                   Reducer reduce, int num_reducers, Partitioner partition,
+                   int num_partitions) {
+  MR_Context *ctx = get_default_context(num_mappers > num_reducers ? num_mappers : num_reducers);
+  MR_RunChunkedInContext(ctx, argc, argv, map, num_mappers, reduce, num_reducers, partition,
+                         num_partitions);
+}
+
+void MR_Run(int argc, char *argv[], Mapper map, int num_mappers, Reducer reduce,
+            int num_reducers, Partitioner partition, int num_partitions) {
+  MR_RunWithCombiner(argc, argv, map, num_mappers, reduce, num_reducers,
+                     partition, num_partitions, NULL);
+}
+
+// Reduces the partitions an earlier job wrote with MR_SetPersistDirectory
+// set, without mapping anything. num_partitions must match that job. Get
+// hands out values straight from a read-only mapping of the files.
+void MR_RunReduceOnly(const char *directory, Reducer reduce, int num_reducers,
+                      int num_partitions) {
+  MR_Context *ctx = get_default_context(num_reducers);
+  char *argv[] = {NULL};
+  run_job(ctx, 1, argv, NULL, NULL, 0, reduce, num_reducers, NULL, num_partitions, NULL,
+          NULL, directory);
+}
+
+// Free what the last job of a series handed back
+void finish_iteration(mr_iteration *iteration) {
+  destroy_partitions(iteration->partition_data_list, iteration->num_partitions);
+  for (int i = 0; i < iteration->num_range_splitters; i++) {
+    free(iteration->range_splitters[i]);
+  }
+  free(iteration->range_splitters);
+}
+
+// Runs rounds of map and reduce until converged returns nonzero. The
+// first round maps the files in argv with map; every later round calls
+// iterate on the records the previous round's reducers kept with
+// MR_EmitResult, one map task per partition, without going through files
+// or re-parsing text. Range splitters are sampled once, in the first round.
+void MR_RunIterative(int argc, char *argv[], Mapper map, RecordMapper iterate,
+                     int num_mappers, Reducer reduce, int num_reducers,
+                     Partitioner partition, int num_partitions, Converged converged) {
+  MR_Context *ctx = get_default_context(num_mappers > num_reducers ? num_mappers : num_reducers);
+  mr_iteration iteration;
+  memset(&iteration, 0, sizeof(mr_iteration));
+  iteration.record_map_function = iterate;
+  iteration.num_partitions = num_partitions;
+  iteration.inputs = (resident_table *)calloc(num_partitions, sizeof(resident_table));
+  iteration.outputs = (resident_table *)calloc(num_partitions, sizeof(resident_table));
+  if (!iteration.inputs || !iteration.outputs) {
+    fprintf(stderr, "Memory allocation failed for iteration tables\n");
+    exit(EXIT_FAILURE);
+  }
+  mr_iteration *outer_iteration = current_iteration;
+  current_iteration = &iteration;
+
+  while (1) {
+    run_job(ctx, argc, argv, map, NULL, num_mappers, reduce, num_reducers, partition,
+            num_partitions, NULL, &iteration, NULL);
+    int done = converged ? converged(iteration.round) : 1;
+    if (done || !iterate) break;
+    // This round's output is the next one's input; the tables of the old
+    // input keep their arrays and newest arena block for the next output
+    resident_table *inputs = iteration.inputs;
+    iteration.inputs = iteration.outputs;
+    iteration.outputs = inputs;
+    for (int i = 0; i < num_partitions; i++) {
+      iteration.outputs[i].records.next_to_fill = 0;
+      arena_reset(&iteration.outputs[i].arena);
+    }
+    iteration.round++;
+  }
+
+  current_iteration = outer_iteration;
+  for (int i = 0; i < num_partitions; i++) {
+    record_list_destroy(&iteration.inputs[i].records);
+    record_list_destroy(&iteration.outputs[i].records);
+    arena_release(&iteration.inputs[i].arena);
+    arena_release(&iteration.outputs[i].arena);
+  }
+  free(iteration.inputs);
+  free(iteration.outputs);
+  finish_iteration(&iteration);
+}
+
+// A stream batch closes once it holds bytes bytes or once its oldest line
+// has waited window_ms milliseconds, whichever comes first
+void MR_SetStreamBatch(size_t bytes, int window_ms) {
+  stream_batch_bytes = bytes > 0 ? bytes : DEFAULT_STREAM_BATCH_BYTES;
+  stream_window_ms = window_ms > 0 ? window_ms : DEFAULT_STREAM_WINDOW_MS;
+}
+
+// Called after every batch of MR_RunStream; NULL, the default, reports nothing
+void MR_SetBatchReporter(BatchReporter reporter) {
+  batch_reporter = reporter;
+}
+
+// Keeps reading while batches are processed, so the arrival time of
+// every byte is known; stops taking input while several batches of
+// complete lines pile up
+void *stream_read_loop(void *arg) {
+  stream_reader *reader = (stream_reader *)arg;
+  char *buffer = malloc(STREAM_READ_SIZE);
+  if (!buffer) {
+    fprintf(stderr, "Memory allocation failed for stream buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  while (1) {
+    ssize_t n = read(reader->fd, buffer, STREAM_READ_SIZE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      fprintf(stderr, "Cannot read stream input\n");
+      exit(EXIT_FAILURE);
+    }
+    ulong now = now_ns();
+    pthread_mutex_lock(&reader->lock);
+    if (n == 0) {
+      reader->eof = 1;
+      pthread_cond_signal(&reader->arrived);
+      pthread_mutex_unlock(&reader->lock);
+      break;
+    }
+    while (reader->len >= STREAM_MAX_PENDING_BATCHES * stream_batch_bytes &&
+           memchr(reader->data, '\n', reader->len)) {
+      pthread_cond_wait(&reader->drained, &reader->lock);
+    }
+    if (reader->len + n > reader->capacity) {
+      size_t capacity = reader->capacity ? reader->capacity * 2 : STREAM_READ_SIZE;
+      while (capacity < reader->len + n) capacity *= 2;
+      char *data = realloc(reader->data, capacity);
+      if (!data) {
+        fprintf(stderr, "Memory allocation failed for stream buffer\n");
+        exit(EXIT_FAILURE);
+      }
+      reader->data = data;
+      reader->capacity = capacity;
+    }
+    if (reader->len == 0) reader->first_byte_ns = now;
+    reader->last_read_ns = now;
+    memcpy(reader->data + reader->len, buffer, n);
+    reader->len += n;
+    pthread_cond_signal(&reader->arrived);
+    pthread_mutex_unlock(&reader->lock);
+  }
+  free(buffer);
+  return NULL;
+}
+
+// Where the batch taken from the pending bytes ends: after the last line
+// that fits in a batch, or after the first line when that one is longer.
+// 0 while not even one line is complete.
+size_t stream_batch_end(stream_reader *reader) {
+  if (reader->len == 0) return 0;
+  size_t limit = reader->len < stream_batch_bytes ? reader->len : stream_batch_bytes;
+  // At the end of the input the last line may lack its newline
+  if (reader->eof && limit == reader->len) return limit;
+  size_t cut = limit;
+  while (cut > 0 && reader->data[cut - 1] != '\n') cut--;
+  if (cut > 0) return cut;
+  char *newline = memchr(reader->data + limit, '\n', reader->len - limit);
+  if (newline) return newline - reader->data + 1;
+  return reader->eof ? reader->len : 0;
+}
+
+// Take the lines of the next batch into batch; 0 once the input is drained
+int stream_next_batch(stream_reader *reader, output_buffer *batch, ulong *arrived_ns) {
+  pthread_mutex_lock(&reader->lock);
+  size_t cut;
+  while (1) {
+    ulong deadline = reader->first_byte_ns + (ulong)stream_window_ms * 1000000UL;
+    int ready = reader->eof || reader->len >= stream_batch_bytes ||
+                (reader->len > 0 && now_ns() >= deadline);
+    cut = stream_batch_end(reader);
+    if (ready && cut > 0) break;
+    if (reader->eof) {
+      pthread_mutex_unlock(&reader->lock);
+      return 0;
+    }
+    if (reader->len > 0 && cut > 0) {
+      struct timespec until = {deadline / 1000000000UL, deadline % 1000000000UL};
+      pthread_cond_timedwait(&reader->arrived, &reader->lock, &until);
+    } else {
+      pthread_cond_wait(&reader->arrived, &reader->lock);
+    }
+  }
+
+  if (cut > batch->capacity) {
+    char *data = realloc(batch->data, cut);
+    if (!data) {
+      fprintf(stderr, "Memory allocation failed for stream batch\n");
+      exit(EXIT_FAILURE);
+    }
+    batch->data = data;
+    batch->capacity = cut;
+  }
+  memcpy(batch->data, reader->data, cut);
+  batch->len = cut;
+  *arrived_ns = reader->first_byte_ns;
+  memmove(reader->data, reader->data + cut, reader->len - cut);
+  reader->len -= cut;
+  // The rest of the line came in with the latest read at the earliest
+  reader->first_byte_ns = reader->last_read_ns;
+  pthread_cond_signal(&reader->drained);
+  pthread_mutex_unlock(&reader->lock);
+  return 1;
+}
+
+// Deal a batch over the mappers' files in line-aligned pieces; returns
+// how many files got lines
+int write_stream_pieces(output_buffer *batch, int *fds, int num_files) {
+  size_t start = 0;
+  int used = 0;
+  for (int i = 0; i < num_files && start < batch->len; i++) {
+    size_t end = start + (batch->len - start) / (num_files - i);
+    if (end == start) end++;
+    while (end < batch->len && batch->data[end - 1] != '\n') end++;
+    if (ftruncate(fds[used], 0) != 0) {
+      fprintf(stderr, "Cannot truncate stream batch file\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t done = 0; done < end - start;) {
+      ssize_t n = pwrite(fds[used], batch->data + start + done, end - start - done, done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        fprintf(stderr, "Cannot write stream batch file\n");
+        exit(EXIT_FAILURE);
+      }
+      done += n;
+    }
+    used++;
+    start = end;
+  }
+  return used;
+}
+
+// Runs one job per micro-batch of the lines read from fd (stdin, a FIFO,
+// a socket) until the end of the input, with the usual file mappers: the
+// lines of a batch are dealt over num_mappers temp files. Workers,
+// partitions and range splitters (sampled from the first batch) stay
+// alive between batches. Each batch goes to the batch reporter, if set.
+void MR_RunStream(int fd, Mapper map, int num_mappers, Reducer reduce, int num_reducers,
+                  Partitioner partition, int num_partitions) {
+  MR_Context *ctx = get_default_context(num_mappers > num_reducers ? num_mappers : num_reducers);
+  stream_reader reader;
+  memset(&reader, 0, sizeof(stream_reader));
+  reader.fd = fd;
+  pthread_mutex_init(&reader.lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&reader.arrived, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&reader.drained, NULL);
+  pthread_t read_thread;
+  if (pthread_create(&read_thread, NULL, stream_read_loop, &reader) != 0) {
+    fprintf(stderr, "Cannot start stream reader\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int *fds = (int *)malloc(sizeof(int) * num_mappers);
+  char **argv = (char **)malloc(sizeof(char *) * (num_mappers + 1));
+  if (!fds || !argv) {
+    fprintf(stderr, "Memory allocation failed for stream batch files\n");
+    exit(EXIT_FAILURE);
+  }
+  argv[0] = "stream";
+  for (int i = 0; i < num_mappers; i++) {
+    fds[i] = create_temp_file("mr-stream", &argv[i + 1]);
+  }
+
+  mr_iteration iteration;
+  memset(&iteration, 0, sizeof(mr_iteration));
+  iteration.num_partitions = num_partitions;
+  output_buffer batch = {NULL, 0, 0};
+  ulong arrived_ns;
+  while (stream_next_batch(&reader, &batch, &arrived_ns)) {
+    int files = write_stream_pieces(&batch, fds, num_mappers);
+    run_job(ctx, files + 1, argv, map, NULL, num_mappers, reduce, num_reducers, partition,
+            num_partitions, NULL, &iteration, NULL);
+    double latency_ms = (now_ns() - arrived_ns) / 1e6;
+    if (batch_reporter) batch_reporter(iteration.round, batch.len, latency_ms);
+    iteration.round++;
+  }
+
+  pthread_join(read_thread, NULL);
+  finish_iteration(&iteration);
+  for (int i = 0; i < num_mappers; i++) {
+    close(fds[i]);
+    unlink(argv[i + 1]);
+    free(argv[i + 1]);
   }
-  destruct_partition_data_list();
-  free(map_function_threads);
-  free(my_sort_threads);
-  free(my_reducer_threads);
-  return;
+  free(fds);
+  free(argv);
+  free(batch.data);
+  free(reader.data);
+  pthread_mutex_destroy(&reader.lock);
+  pthread_cond_destroy(&reader.arrived);
+  pthread_cond_destroy(&reader.drained);
 }
\ No newline at end of file
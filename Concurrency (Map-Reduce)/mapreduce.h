@@ -0,0 +1,129 @@
+#ifndef __mapreduce_h__
+#define __mapreduce_h__
+
+#include <stddef.h>
+
+// Different function pointer types used by MR
+typedef char *(*Getter)(char *key, int partition_number);
+typedef void (*Mapper)(char *file_name);
+typedef void (*Reducer)(char *key, Getter get_func, int partition_number);
+typedef unsigned long (*Partitioner)(char *key, int num_partitions);
+
+// Folds value into the accumulated value for key. The result is copied
+// right away, so it may be a static buffer or either of the arguments.
+typedef char *(*Combiner)(char *key, char *accumulated, char *value);
+
+// Maps one newline-aligned chunk of file_name. data points straight into a
+// private mapping of the file: it is not NUL-terminated, and writes to it
+// stay local to the job.
+typedef void (*ChunkMapper)(char *data, size_t len, char *file_name);
+
+// Maps one record kept by the previous round of an iterative job. key and
+// value are NUL-terminated but may be binary, hence the lengths.
+typedef void (*RecordMapper)(char *key, size_t key_len, char *value, size_t len,
+                             int partition_number);
+
+// Called after every round of MR_RunIterative; nonzero stops the job
+typedef int (*Converged)(int round);
+
+// Told about every batch of MR_RunStream once it is reduced; latency runs
+// from the arrival of the batch's oldest byte to the end of its reduce
+typedef void (*BatchReporter)(int batch, size_t bytes, double latency_ms);
+
+// Worker pool that jobs run on; see MR_CreateContext
+typedef struct __MR_Context MR_Context;
+
+// Position of a reducer within the values of one key
+typedef struct __MR_Cursor MR_Cursor;
+
+// One running job; see MR_AttachJob
+typedef struct __MR_Job MR_Job;
+
+// Reduce modes: the original chained reducers, fully parallel reducers,
+// and parallel reducers whose MR_Printf output is replayed in partition order
+#define MR_REDUCE_SERIAL 0
+#define MR_REDUCE_PARALLEL 1
+#define MR_REDUCE_ORDERED 2
+
+// Worker placement: wherever the scheduler likes, or one CPU per worker
+// with consecutive workers on different NUMA nodes
+#define MR_AFFINITY_NONE 0
+#define MR_AFFINITY_PINNED 1
+
+// External functions
+void MR_Emit(char *key, char *value);
+void MR_EmitBytes(char *key, size_t key_len, void *value, size_t len);
+void MR_EmitLong(char *key, long value);
+
+// The 64-bit hash MR_Emit keeps with every record; MR_DefaultHashPartition
+// is this hash modulo the number of partitions
+unsigned long MR_KeyHash(char *key, size_t key_len);
+unsigned long MR_DefaultHashPartition(char *key, int num_partitions);
+unsigned long MR_SortedPartition(char *key, int num_partitions);
+unsigned long MR_SampledRangePartition(char *key, int num_partitions);
+
+void MR_Run(int argc, char *argv[], Mapper map, int num_mappers, Reducer reduce,
+            int num_reducers, Partitioner partition, int num_partitions);
+void MR_RunWithCombiner(int argc, char *argv[], Mapper map, int num_mappers,
+                        Reducer reduce, int num_reducers, Partitioner partition,
+                        int num_partitions, Combiner combine);
+void MR_RunChunked(int argc, char *argv[], ChunkMapper map, int num_mappers,
+                   Reducer reduce, int num_reducers, Partitioner partition,
+                   int num_partitions);
+void MR_RunIterative(int argc, char *argv[], Mapper map, RecordMapper iterate,
+                     int num_mappers, Reducer reduce, int num_reducers,
+                     Partitioner partition, int num_partitions, Converged converged);
+void MR_RunStream(int fd, Mapper map, int num_mappers, Reducer reduce, int num_reducers,
+                  Partitioner partition, int num_partitions);
+void MR_RunReduceOnly(const char *directory, Reducer reduce, int num_reducers,
+                      int num_partitions);
+
+// Threads a mapper starts itself emit into its job once attached: the
+// mapper hands them MR_CurrentJob(), and they detach with
+// MR_AttachJob(NULL) before the mapper returns
+MR_Job *MR_CurrentJob(void);
+void MR_AttachJob(MR_Job *job);
+
+// Worker pools
+MR_Context *MR_CreateContext(int num_threads);
+void MR_DestroyContext(MR_Context *ctx);
+void MR_RunInContext(MR_Context *ctx, int argc, char *argv[], Mapper map,
+                     int num_mappers, Reducer reduce, int num_reducers,
+                     Partitioner partition, int num_partitions, Combiner combine);
+void MR_RunChunkedInContext(MR_Context *ctx, int argc, char *argv[], ChunkMapper map,
+                            int num_mappers, Reducer reduce, int num_reducers,
+                            Partitioner partition, int num_partitions);
+
+// Reducer side
+MR_Cursor *MR_GetCursor(char *key, int num_partition);
+char *MR_CursorNext(MR_Cursor *cursor);
+int MR_CursorNextBatch(MR_Cursor *cursor, char **values, int max_values);
+int MR_GetBatch(char *key, int num_partition, char **values, int max_values);
+char *MR_GetBytes(char *key, int num_partition, size_t *len);
+int MR_GetLong(char *key, int num_partition, long *value);
+size_t MR_KeyLength(char *key);
+void MR_Printf(const char *format, ...);
+void MR_EmitResult(char *key, char *value);
+void MR_EmitResultBytes(char *key, size_t key_len, void *value, size_t len);
+void MR_ForEachResult(RecordMapper fn);
+
+// Settings, read when a job starts
+void MR_SetReduceMode(int mode);
+void MR_SetHashGrouping(int enabled);
+void MR_SetKeyInterning(int enabled);
+void MR_SetPartitionSplitting(int enabled);
+void MR_SetAffinity(int policy);
+void MR_SetSpillBudget(size_t budget);
+void MR_SetSpillDirectory(const char *directory);
+void MR_SetMemoryBudget(size_t budget);
+size_t MR_GetResidentBytes();
+void MR_SetPersistDirectory(const char *directory);
+void MR_SetArenaBlockSize(size_t block_size);
+void MR_SetArenaHugePages(int enable);
+void MR_SetInputSplitSize(size_t split_size);
+void MR_SetSampleSize(size_t bytes);
+void MR_SetStreamBatch(size_t bytes, int window_ms);
+void MR_SetBatchReporter(BatchReporter reporter);
+void MR_SetReportFile(const char *path);
+
+#endif // __mapreduce_h__
@@ -0,0 +1,686 @@
+// Throughput benchmark for the MapReduce library.
+//
+//   gcc -O2 -pthread mapreduce.c mr-bench.c -o mr-bench -lm
+//   ./mr-bench [-j job] [-d dataset] [-n records] [-f files] [-i runs]
+//              [-m mappers] [-r reducers] [-p partitions] [-g pattern] [-k]
+//              [-a none|pinned|both]
+//
+// Generates a synthetic corpus in a temp directory, then runs the job once
+// per configuration and prints one CSV line per run. -m, -r and -p take
+// comma-separated lists; each list is swept while the other two stay at
+// their first value, which gives the scaling curve of each parameter.
+// -a both runs the whole sweep unpinned, then with pinned workers and
+// node-local partitions, to compare the two.
+//
+// jobs:     wordcount, index (inverted index), sort (range-partitioned
+//           sort, written in order to a file and checked), grep (lines
+//           containing -g pattern), sorttime (partition sort time of
+//           wordcount, summed over partitions from the job report, next
+//           to the old qsort-with-strcmp sort of the same partitions; both
+//           in milliseconds per million records), map (microbenchmark of the combiner's hash
+//           map over the dataset's keys; prints operations per second
+//           instead and ignores -m, -r and -p), hash (microbenchmark of
+//           the per-emit hashing into -p combine tables, MR_KeyHash once
+//           against the old DJB2 partition hash plus FNV table hash;
+//           prints nanoseconds per key byte and ignores -m and -r)
+// datasets: zipf (Zipfian words, ten per line), ints (uniform 32-bit
+//           integers), urls (high-cardinality URL-like keys)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include "mapreduce.h"
+#include "map.h"
+
+#define MAX_SWEEP 32
+#define ZIPF_VOCABULARY 100000
+#define ZIPF_EXPONENT 1.0
+#define WORDS_PER_LINE 10
+
+typedef struct __sweep {
+  int values[MAX_SWEEP];
+  int count;
+} sweep;
+
+char *job_name = "wordcount";
+char *dataset_name = "zipf";
+long num_records = 2000000;
+int num_files = 8;
+int num_runs = 3;
+char *grep_pattern = "ab";
+int keep_files = 0;
+int affinity = MR_AFFINITY_NONE;
+char *sort_output;  // where the sort job's output goes
+char *report_file;  // job report the sorttime job reads
+char **sort_keys;   // every input word, for the sorttime baseline
+long num_sort_keys;
+
+long input_records = 0;
+long output_keys = 0;
+long output_values = 0;
+
+// xorshift64*, one state per generator so datasets are reproducible
+unsigned long next_random(unsigned long *state) {
+  unsigned long x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DUL;
+}
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Pronounceable word for a vocabulary rank; distinct ranks give distinct words
+void rank_word(long rank, char *word) {
+  static const char *syllables[] = {"ka", "be", "lo", "mi", "nu", "ra", "se", "ti",
+                                    "vo", "za", "du", "fe", "gi", "ho", "ju", "ab"};
+  int len = 0;
+  do {
+    memcpy(word + len, syllables[rank % 16], 2);
+    len += 2;
+    rank /= 16;
+  } while (rank > 0);
+  word[len] = '\0';
+}
+
+// Cumulative Zipf distribution over the vocabulary, sampled by bisection
+double *zipf_cdf() {
+  double *cdf = malloc(sizeof(double) * ZIPF_VOCABULARY);
+  if (!cdf) {
+    fprintf(stderr, "Memory allocation failed for Zipf table\n");
+    exit(EXIT_FAILURE);
+  }
+  double sum = 0;
+  for (int i = 0; i < ZIPF_VOCABULARY; i++) {
+    sum += 1.0 / pow(i + 1, ZIPF_EXPONENT);
+    cdf[i] = sum;
+  }
+  for (int i = 0; i < ZIPF_VOCABULARY; i++) {
+    cdf[i] /= sum;
+  }
+  return cdf;
+}
+
+long zipf_rank(double *cdf, unsigned long *state) {
+  double u = (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+  long lo = 0, hi = ZIPF_VOCABULARY - 1;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Write num_records records of the dataset spread over num_files files
+void generate_inputs(char *directory, char **paths) {
+  double *cdf = strcmp(dataset_name, "zipf") == 0 ? zipf_cdf() : NULL;
+  if (!cdf && strcmp(dataset_name, "ints") != 0 && strcmp(dataset_name, "urls") != 0) {
+    fprintf(stderr, "Unknown dataset %s\n", dataset_name);
+    exit(EXIT_FAILURE);
+  }
+  unsigned long state = 0x9E3779B97F4A7C15UL;
+  char word[64];
+  for (int f = 0; f < num_files; f++) {
+    paths[f] = malloc(strlen(directory) + 32);
+    sprintf(paths[f], "%s/input-%d.txt", directory, f);
+    FILE *file = fopen(paths[f], "w");
+    if (!file) {
+      fprintf(stderr, "Cannot create %s\n", paths[f]);
+      exit(EXIT_FAILURE);
+    }
+    long records = num_records / num_files + (f < num_records % num_files);
+    for (long i = 0; i < records; i++) {
+      if (cdf) {
+        rank_word(zipf_rank(cdf, &state), word);
+        fputs(word, file);
+        fputc((i + 1) % WORDS_PER_LINE == 0 || i + 1 == records ? '\n' : ' ', file);
+      } else if (dataset_name[0] == 'i') {
+        fprintf(file, "%u\n", (unsigned)(next_random(&state) >> 32));
+      } else {
+        unsigned long r = next_random(&state);
+        fprintf(file, "http://host%lu.example.com/%lx/%lx/item?id=%lu\n", r % 5000,
+                (r >> 16) & 0xffff, (r >> 32) & 0xfff, r >> 44);
+      }
+    }
+    fclose(file);
+  }
+  free(cdf);
+}
+
+void count_input(long records) {
+  __atomic_add_fetch(&input_records, records, __ATOMIC_RELAXED);
+}
+
+void WordCountMap(char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  char *line = NULL, *token, *rest;
+  size_t size = 0;
+  long records = 0;
+  while (getline(&line, &size, file) != -1) {
+    rest = line;
+    while ((token = strsep(&rest, " \n")) != NULL) {
+      if (*token == '\0') continue;
+      MR_Emit(token, "1");
+      records++;
+    }
+  }
+  free(line);
+  fclose(file);
+  count_input(records);
+}
+
+// Postings are file:line, so every line of a file is its own document
+void IndexMap(char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  const char *base = strrchr(file_name, '/') ? strrchr(file_name, '/') + 1 : file_name;
+  char *line = NULL, *token, *rest;
+  char posting[256];
+  size_t size = 0;
+  long records = 0, line_number = 0;
+  while (getline(&line, &size, file) != -1) {
+    snprintf(posting, sizeof(posting), "%s:%ld", base, ++line_number);
+    rest = line;
+    while ((token = strsep(&rest, " \n")) != NULL) {
+      if (*token == '\0') continue;
+      MR_Emit(token, posting);
+      records++;
+    }
+  }
+  free(line);
+  fclose(file);
+  count_input(records);
+}
+
+void GrepMap(char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  char *line = NULL;
+  size_t size = 0;
+  long records = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, file)) != -1) {
+    records++;
+    if (!strstr(line, grep_pattern)) continue;
+    if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+    MR_Emit(line, "1");
+  }
+  free(line);
+  fclose(file);
+  count_input(records);
+}
+
+void CountReduce(char *key, Getter get_next, int partition_number) {
+  long values = 0;
+  while (get_next(key, partition_number) != NULL) {
+    values++;
+  }
+  __atomic_add_fetch(&output_keys, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&output_values, values, __ATOMIC_RELAXED);
+}
+
+// One line per value, so the output holds every input key in order
+void SortReduce(char *key, Getter get_next, int partition_number) {
+  long values = 0;
+  while (get_next(key, partition_number) != NULL) {
+    MR_Printf("%s\n", key);
+    values++;
+  }
+  __atomic_add_fetch(&output_keys, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&output_values, values, __ATOMIC_RELAXED);
+}
+
+// Send stdout to path for the length of a run; returns the old stdout
+int redirect_stdout(char *path) {
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  FILE *file = fopen(path, "w");
+  if (saved < 0 || !file || dup2(fileno(file), STDOUT_FILENO) < 0) {
+    fprintf(stderr, "Cannot redirect output to %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  fclose(file);
+  return saved;
+}
+
+void restore_stdout(int saved) {
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+}
+
+void check_sorted(char *path, long expected) {
+  FILE *file = fopen(path, "r");
+  char *line = NULL, *previous = NULL;
+  size_t size = 0, previous_size = 0;
+  long lines = 0;
+  while (file && getline(&line, &size, file) != -1) {
+    if (previous && strcmp(previous, line) > 0) {
+      fprintf(stderr, "sort output out of order at line %ld\n", lines + 1);
+      exit(EXIT_FAILURE);
+    }
+    char *swap = previous;
+    previous = line;
+    line = swap;
+    size_t swap_size = previous_size;
+    previous_size = size;
+    size = swap_size;
+    lines++;
+  }
+  if (file) fclose(file);
+  free(line);
+  free(previous);
+  if (lines != expected) {
+    fprintf(stderr, "sort output has %ld of %ld records\n", lines, expected);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Summed partition sort time of the last job, in seconds
+double read_sort_seconds(char *path) {
+  FILE *file = fopen(path, "r");
+  char line[256];
+  double ms = -1;
+  while (file && fgets(line, sizeof(line), file)) {
+    if (sscanf(line, " \"sort_cpu_ms\": %lf", &ms) == 1) break;
+  }
+  if (file) fclose(file);
+  if (ms < 0) {
+    fprintf(stderr, "No sort time in job report %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return ms / 1e3;
+}
+
+void parse_sweep(char *arg, sweep *s) {
+  s->count = 0;
+  for (char *value = strtok(arg, ","); value; value = strtok(NULL, ",")) {
+    if (s->count == MAX_SWEEP || atoi(value) <= 0) {
+      fprintf(stderr, "Bad list %s\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    s->values[s->count++] = atoi(value);
+  }
+}
+
+// Every word of the inputs, in input order
+char **read_keys(int argc, char **argv, long *count) {
+  long capacity = num_records > 0 ? num_records : 1;
+  char **keys = malloc(sizeof(char *) * capacity);
+  *count = 0;
+  for (int f = 1; f < argc; f++) {
+    FILE *file = fopen(argv[f], "r");
+    char *line = NULL, *token, *rest;
+    size_t size = 0;
+    while (getline(&line, &size, file) != -1) {
+      rest = line;
+      while ((token = strsep(&rest, " \n")) != NULL) {
+        if (*token == '\0') continue;
+        if (*count == capacity) {
+          capacity *= 2;
+          keys = realloc(keys, sizeof(char *) * capacity);
+        }
+        keys[(*count)++] = strdup(token);
+      }
+    }
+    free(line);
+    fclose(file);
+  }
+  return keys;
+}
+
+int key_comparator(const void *key1, const void *key2) {
+  return strcmp(*(char **)key1, *(char **)key2);
+}
+
+// The sort the library did before the radix sort: qsort with strcmp over
+// each partition's keys, hash partitioned like the job. Best of num_runs,
+// summed over partitions, in seconds
+double qsort_seconds(int argc, char **argv, int partitions) {
+  if (!sort_keys) sort_keys = read_keys(argc, argv, &num_sort_keys);
+  char **sorted = malloc(sizeof(char *) * (num_sort_keys + 1));
+  long *starts = calloc(partitions + 1, sizeof(long));
+  for (long i = 0; i < num_sort_keys; i++) {
+    starts[MR_DefaultHashPartition(sort_keys[i], partitions) + 1]++;
+  }
+  for (int p = 0; p < partitions; p++) {
+    starts[p + 1] += starts[p];
+  }
+  double best = 0;
+  for (int run = 0; run < num_runs; run++) {
+    long *next = malloc(sizeof(long) * partitions);
+    memcpy(next, starts, sizeof(long) * partitions);
+    for (long i = 0; i < num_sort_keys; i++) {
+      sorted[next[MR_DefaultHashPartition(sort_keys[i], partitions)]++] = sort_keys[i];
+    }
+    free(next);
+    double start = now_seconds();
+    for (int p = 0; p < partitions; p++) {
+      qsort(sorted + starts[p], starts[p + 1] - starts[p], sizeof(char *), key_comparator);
+    }
+    double elapsed = now_seconds() - start;
+    if (run == 0 || elapsed < best) best = elapsed;
+  }
+  free(sorted);
+  free(starts);
+  return best;
+}
+
+// Best of num_runs runs, in input records per second
+void run_config(int argc, char **argv, int mappers, int reducers, int partitions) {
+  Mapper map = WordCountMap;
+  Reducer reduce = CountReduce;
+  Partitioner partition = MR_DefaultHashPartition;
+  int sorting = strcmp(job_name, "sort") == 0;
+  int timing_sort = strcmp(job_name, "sorttime") == 0;
+  if (strcmp(job_name, "index") == 0) {
+    map = IndexMap;
+  } else if (sorting) {
+    reduce = SortReduce;
+    partition = MR_SampledRangePartition;
+  } else if (strcmp(job_name, "grep") == 0) {
+    map = GrepMap;
+  } else if (strcmp(job_name, "wordcount") != 0 && !timing_sort) {
+    fprintf(stderr, "Unknown job %s\n", job_name);
+    exit(EXIT_FAILURE);
+  }
+
+  double best = 0;
+  long records = 0, keys = 0, values = 0;
+  MR_SetAffinity(affinity);
+  // The sort replays each partition's output in partition order, and
+  // range partitions are in key order, so the whole output is sorted
+  MR_SetReduceMode(sorting ? MR_REDUCE_ORDERED : MR_REDUCE_SERIAL);
+  MR_SetReportFile(timing_sort ? report_file : NULL);
+  for (int run = 0; run < num_runs; run++) {
+    input_records = output_keys = output_values = 0;
+    int saved_stdout = sorting ? redirect_stdout(sort_output) : -1;
+    double start = now_seconds();
+    MR_Run(argc, argv, map, mappers, reduce, reducers, partition, partitions);
+    double elapsed = now_seconds() - start;
+    if (sorting) {
+      restore_stdout(saved_stdout);
+      check_sorted(sort_output, output_values);
+    }
+    if (timing_sort) elapsed = read_sort_seconds(report_file);
+    if (run == 0 || elapsed < best) best = elapsed;
+    // The sampling pass of the sort maps part of the input twice, but
+    // every input record reaches a reducer exactly once
+    records = partition == MR_SampledRangePartition ? output_values : input_records;
+    keys = output_keys;
+    values = output_values;
+  }
+  if (timing_sort) {
+    double baseline = qsort_seconds(argc, argv, partitions);
+    printf("%s,%s,%d,%d,%d,%ld,%.3f,%.3f,%s\n", job_name, dataset_name, mappers, reducers,
+           partitions, records, best * 1e9 / records, baseline * 1e9 / records,
+           affinity == MR_AFFINITY_PINNED ? "pinned" : "none");
+  } else {
+    printf("%s,%s,%d,%d,%d,%ld,%ld,%ld,%.4f,%.0f,%s\n", job_name, dataset_name, mappers,
+           reducers, partitions, records, keys, values, best, records / best,
+           affinity == MR_AFFINITY_PINNED ? "pinned" : "none");
+  }
+  fflush(stdout);
+}
+
+// Count every key the way the combiner does (look up, then insert when
+// missing), look every key up again, then look up keys that are absent.
+// Best of num_runs, in operations per second.
+void run_map_bench(int argc, char **argv) {
+  long count;
+  char **keys = read_keys(argc, argv, &count);
+  char **misses = malloc(sizeof(char *) * (count + 1));
+  for (long i = 0; i < count; i++) {
+    misses[i] = malloc(strlen(keys[i]) + 2);
+    sprintf(misses[i], "%s#", keys[i]);
+  }
+
+  double upserts = 0, lookups = 0, misses_per_sec = 0;
+  long distinct = 0, found = 0;
+  for (int run = 0; run < num_runs; run++) {
+    map_int_t counts;
+    initialize_map(&counts);
+    double start = now_seconds();
+    for (long i = 0; i < count; i++) {
+      int *value = map_get(&counts, keys[i]);
+      if (value) {
+        (*value)++;
+      } else if (map_set(&counts, keys[i], 1) != 0) {
+        fprintf(stderr, "Memory allocation failed for map\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    double upsert_time = now_seconds() - start;
+
+    found = 0;
+    start = now_seconds();
+    for (long i = 0; i < count; i++) {
+      found += map_get(&counts, keys[i]) != NULL;
+    }
+    double lookup_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (long i = 0; i < count; i++) {
+      found += map_get(&counts, misses[i]) != NULL;
+    }
+    double miss_time = now_seconds() - start;
+
+    distinct = counts.base.nnodes;
+    destroy_map(&counts);
+    if (count / upsert_time > upserts) upserts = count / upsert_time;
+    if (count / lookup_time > lookups) lookups = count / lookup_time;
+    if (count / miss_time > misses_per_sec) misses_per_sec = count / miss_time;
+  }
+  if (found != count) {
+    fprintf(stderr, "map lookups found %ld of %ld keys\n", found, count);
+    exit(EXIT_FAILURE);
+  }
+  printf("job,dataset,records,keys,upserts_per_sec,lookups_per_sec,misses_per_sec\n");
+  printf("map,%s,%ld,%ld,%.0f,%.0f,%.0f\n", dataset_name, count, distinct, upserts, lookups,
+         misses_per_sec);
+
+  for (long i = 0; i < count; i++) {
+    free(keys[i]);
+    free(misses[i]);
+  }
+  free(keys);
+  free(misses);
+}
+
+// The partition hash MR_DefaultHashPartition used before MR_KeyHash
+unsigned long djb2_hash(char *key) {
+  unsigned long hash = 5381;
+  int c;
+  while ((c = *key++) != '\0') hash = hash * 33 + c;
+  return hash;
+}
+
+// Pick a partition and count the key in that partition's combine table,
+// the way MR_Emit does: once hashing each key twice (DJB2 for the
+// partition, FNV inside map_get and map_set), once hashing it a single
+// time with MR_KeyHash and handing the table its high half. Best of
+// num_runs, in nanoseconds per key byte.
+void run_hash_bench(int argc, char **argv, int partitions) {
+  long count;
+  char **keys = read_keys(argc, argv, &count);
+  long bytes = 0;
+  for (long i = 0; i < count; i++) {
+    bytes += strlen(keys[i]);
+  }
+  map_int_t *tables = malloc(sizeof(map_int_t) * partitions);
+
+  double old_best = 0, new_best = 0;
+  long old_keys = 0, new_keys = 0;
+  for (int run = 0; run < num_runs; run++) {
+    for (int rehash = 1; rehash >= 0; rehash--) {
+      for (int p = 0; p < partitions; p++) {
+        initialize_map(&tables[p]);
+      }
+      double start = now_seconds();
+      for (long i = 0; i < count; i++) {
+        char *key = keys[i];
+        map_int_t *table;
+        int *value, failed;
+        if (rehash) {
+          table = &tables[djb2_hash(key) % partitions];
+          value = map_get(table, key);
+          failed = !value && map_set(table, key, 1) != 0;
+        } else {
+          unsigned long hash = MR_KeyHash(key, strlen(key));
+          table = &tables[hash % partitions];
+          value = map_get_hashed(table, key, (unsigned)(hash >> 32));
+          failed = !value && map_set_hashed(table, key, (unsigned)(hash >> 32), 1) != 0;
+        }
+        if (failed) {
+          fprintf(stderr, "Memory allocation failed for map\n");
+          exit(EXIT_FAILURE);
+        }
+        if (value) (*value)++;
+      }
+      double elapsed = now_seconds() - start;
+      long distinct = 0;
+      for (int p = 0; p < partitions; p++) {
+        distinct += tables[p].base.nnodes;
+        destroy_map(&tables[p]);
+      }
+      if (rehash) {
+        if (run == 0 || elapsed < old_best) old_best = elapsed;
+        old_keys = distinct;
+      } else {
+        if (run == 0 || elapsed < new_best) new_best = elapsed;
+        new_keys = distinct;
+      }
+    }
+  }
+  if (old_keys != new_keys) {
+    fprintf(stderr, "hash paths counted %ld and %ld keys\n", old_keys, new_keys);
+    exit(EXIT_FAILURE);
+  }
+  printf("job,dataset,records,bytes,keys,partitions,old_ns_per_byte,new_ns_per_byte\n");
+  printf("hash,%s,%ld,%ld,%ld,%d,%.3f,%.3f\n", dataset_name, count, bytes, new_keys,
+         partitions, old_best * 1e9 / bytes, new_best * 1e9 / bytes);
+
+  for (long i = 0; i < count; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+  free(tables);
+}
+
+int main(int argc, char *argv[]) {
+  sweep mappers = {{4}, 1}, reducers = {{4}, 1}, partitions = {{16}, 1};
+  int policies[2] = {MR_AFFINITY_NONE}, num_policies = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:d:n:f:i:m:r:p:g:ka:")) != -1) {
+    switch (opt) {
+      case 'j': job_name = optarg; break;
+      case 'd': dataset_name = optarg; break;
+      case 'n': num_records = atol(optarg); break;
+      case 'f': num_files = atoi(optarg); break;
+      case 'i': num_runs = atoi(optarg); break;
+      case 'm': parse_sweep(optarg, &mappers); break;
+      case 'r': parse_sweep(optarg, &reducers); break;
+      case 'p': parse_sweep(optarg, &partitions); break;
+      case 'g': grep_pattern = optarg; break;
+      case 'k': keep_files = 1; break;
+      case 'a':
+        if (strcmp(optarg, "none") == 0) {
+          num_policies = 1;
+        } else if (strcmp(optarg, "pinned") == 0) {
+          policies[0] = MR_AFFINITY_PINNED;
+          num_policies = 1;
+        } else if (strcmp(optarg, "both") == 0) {
+          policies[0] = MR_AFFINITY_NONE;
+          policies[1] = MR_AFFINITY_PINNED;
+          num_policies = 2;
+        } else {
+          fprintf(stderr, "Unknown affinity %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-j wordcount|index|sort|grep|sorttime|map|hash] [-d zipf|ints|urls] "
+                        "[-n records] [-f files] [-i runs] [-m list] [-r list] [-p list] "
+                        "[-g pattern] [-k] [-a none|pinned|both]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (num_records <= 0 || num_files <= 0 || num_runs <= 0) {
+    fprintf(stderr, "Records, files and runs must be positive\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char directory[] = "/tmp/mr-bench-XXXXXX";
+  if (!mkdtemp(directory)) {
+    fprintf(stderr, "Cannot create %s\n", directory);
+    exit(EXIT_FAILURE);
+  }
+  char **inputs = malloc(sizeof(char *) * (num_files + 1));
+  inputs[0] = argv[0];
+  double start = now_seconds();
+  generate_inputs(directory, inputs + 1);
+  fprintf(stderr, "generated %ld %s records in %s (%.2fs)\n", num_records, dataset_name,
+          directory, now_seconds() - start);
+
+  if (strcmp(job_name, "map") == 0) {
+    run_map_bench(num_files + 1, inputs);
+    mappers.count = reducers.count = partitions.count = 0;
+  } else if (strcmp(job_name, "hash") == 0) {
+    run_hash_bench(num_files + 1, inputs, partitions.values[0]);
+    mappers.count = reducers.count = partitions.count = 0;
+  } else if (strcmp(job_name, "sorttime") == 0) {
+    printf("job,dataset,mappers,reducers,partitions,records,sort_ms_per_million,"
+           "qsort_ms_per_million,affinity\n");
+  } else {
+    printf("job,dataset,mappers,reducers,partitions,records,keys,values,seconds,"
+           "records_per_sec,affinity\n");
+  }
+  sort_output = malloc(strlen(directory) + 32);
+  sprintf(sort_output, "%s/sorted.txt", directory);
+  report_file = malloc(strlen(directory) + 32);
+  sprintf(report_file, "%s/report.json", directory);
+  for (int a = 0; a < num_policies; a++) {
+    affinity = policies[a];
+    for (int i = 0; i < mappers.count; i++) {
+      run_config(num_files + 1, inputs, mappers.values[i], reducers.values[0],
+                 partitions.values[0]);
+    }
+    for (int i = 1; i < reducers.count; i++) {
+      run_config(num_files + 1, inputs, mappers.values[0], reducers.values[i],
+                 partitions.values[0]);
+    }
+    for (int i = 1; i < partitions.count; i++) {
+      run_config(num_files + 1, inputs, mappers.values[0], reducers.values[0],
+                 partitions.values[i]);
+    }
+  }
+
+  for (int f = 1; f <= num_files; f++) {
+    if (!keep_files) unlink(inputs[f]);
+    free(inputs[f]);
+  }
+  if (!keep_files) {
+    unlink(sort_output);
+    unlink(report_file);
+    rmdir(directory);
+  }
+  for (long i = 0; i < num_sort_keys; i++) {
+    free(sort_keys[i]);
+  }
+  free(sort_keys);
+  free(sort_output);
+  free(report_file);
+  free(inputs);
+  return 0;
+}